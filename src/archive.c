@@ -0,0 +1,300 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+
+#include "core.h"
+#include "archive.h"
+
+bool LoadArchive(Archive *res, const char *filename)
+{
+    memset(res, 0, sizeof(Archive));
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ArchiveHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    // Private and writable: pages are shared with the page cache until
+    // something writes to them
+    void *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+
+    const ArchiveHeader *header = (const ArchiveHeader*)data;
+    size_t tocEnd = sizeof(ArchiveHeader) + (size_t)header->entryCount * sizeof(ArchiveEntry);
+    if (header->magic != ARCHIVE_MAGIC || header->version != ARCHIVE_VERSION || tocEnd > (size_t)st.st_size)
+    {
+        munmap(data, st.st_size);
+        return false;
+    }
+
+    const ArchiveEntry *entries = (const ArchiveEntry*)(header + 1);
+    for (Uint32 i = 0; i < header->entryCount; i++) {
+        if (entries[i].offset % ARCHIVE_ALIGN != 0 ||
+            entries[i].offset > st.st_size || entries[i].size > st.st_size - entries[i].offset) {
+            munmap(data, st.st_size);
+            return false;
+        }
+    }
+
+    res->data = (Uint8*)data;
+    res->size = st.st_size;
+    res->entries = entries;
+    res->entryCount = header->entryCount;
+
+    return true;
+}
+
+void UnloadArchive(Archive *archive)
+{
+    if (archive->data != NULL) {
+        munmap(archive->data, archive->size);
+    }
+
+    archive->data = NULL;
+    archive->size = 0;
+    archive->entries = NULL;
+    archive->entryCount = 0;
+}
+
+static int compareEntryName(const void *name, const void *entry)
+{
+    return strncmp((const char*)name, ((const ArchiveEntry*)entry)->name, ARCHIVE_NAME_LENGTH);
+}
+
+const void *FindArchiveEntry(const Archive *archive, const char *name, int type, Uint32 *size)
+{
+    if (archive->entryCount == 0) {
+        return NULL;
+    }
+
+    const ArchiveEntry *entry = (const ArchiveEntry*)bsearch(name, archive->entries,
+        archive->entryCount, sizeof(ArchiveEntry), compareEntryName);
+    if (entry == NULL || entry->type != (Uint32)type) {
+        return NULL;
+    }
+
+    if (size != NULL) {
+        *size = entry->size;
+    }
+    return archive->data + entry->offset;
+}
+
+// Whether `count` items of `itemSize` bytes at `offset` lie within a blob of
+// `size` bytes, ARCHIVE_ALIGN aligned as the packer lays them out. Blobs
+// are checked before anything points into them, and the loaders fall back
+// to the loose files when they do not hold up.
+static bool fitsInBlob(Uint32 size, Uint32 offset, Uint64 count, size_t itemSize)
+{
+    return offset % ARCHIVE_ALIGN == 0 && offset <= size && count * itemSize <= size - offset;
+}
+
+static bool checkImage(const Uint8 *blob, Uint32 size)
+{
+    if (!fitsInBlob(size, 0, 1, sizeof(ArchiveImage))) {
+        return false;
+    }
+
+    // SDL 1.2 surfaces keep their pitch in 16 bits
+    const ArchiveImage *image = (const ArchiveImage*)blob;
+    Uint32 bytes = image->bitsPerPixel / 8;
+    return (image->bitsPerPixel == 16 || image->bitsPerPixel == 24 || image->bitsPerPixel == 32)
+        && image->width > 0 && image->height > 0 && image->pitch <= 0xffff
+        && image->pitch >= (Uint64)image->width * bytes
+        && fitsInBlob(size, image->pixels, image->height, image->pitch);
+}
+
+SDL_Surface *LoadImageFromArchive(const Archive *archive, const char *filename)
+{
+    Uint32 size;
+    const Uint8 *blob = (const Uint8*)FindArchiveEntry(archive, filename, ARCHIVE_IMAGE, &size);
+    if (blob == NULL || !checkImage(blob, size))
+    {
+        return IMG_Load(filename);
+    }
+
+    const ArchiveImage *image = (const ArchiveImage*)blob;
+    SDL_Surface *surface = SDL_CreateRGBSurfaceFrom((void*)(blob + image->pixels),
+        image->width, image->height, image->bitsPerPixel, image->pitch,
+        image->Rmask, image->Gmask, image->Bmask, image->Amask);
+    if (surface == NULL)
+    {
+        return NULL;
+    }
+    if (image->flags & SDL_SRCCOLORKEY) {
+        SDL_SetColorKey(surface, SDL_SRCCOLORKEY, image->colorkey);
+    }
+    if (image->flags & SDL_SRCALPHA) {
+        SDL_SetAlpha(surface, SDL_SRCALPHA, SDL_ALPHA_OPAQUE);
+    }
+
+    // Packed for a screen in another format, blits would convert every time
+    SDL_PixelFormat *screen = Platform_GetScreenFormat();
+    if (image->Amask == 0 && (image->bitsPerPixel != screen->BitsPerPixel ||
+        image->Rmask != screen->Rmask || image->Gmask != screen->Gmask || image->Bmask != screen->Bmask))
+    {
+        SDL_Surface *converted = SDL_ConvertSurface(surface, screen, SDL_SWSURFACE);
+        SDL_FreeSurface(surface);
+        return converted;
+    }
+
+    return surface;
+}
+
+static bool checkSound(const Uint8 *blob, Uint32 size)
+{
+    const ArchiveSound *sound = (const ArchiveSound*)blob;
+    return fitsInBlob(size, 0, 1, sizeof(ArchiveSound))
+        && fitsInBlob(size, sound->samples, sound->length, 1);
+}
+
+Mix_Chunk *LoadSoundFromArchive(const Archive *archive, const char *filename)
+{
+    Uint32 size;
+    const Uint8 *blob = (const Uint8*)FindArchiveEntry(archive, filename, ARCHIVE_SOUND, &size);
+    int frequency, channels;
+    Uint16 format;
+    if (blob == NULL || !checkSound(blob, size) || !Mix_QuerySpec(&frequency, &format, &channels))
+    {
+        return Mix_LoadWAV(filename);
+    }
+
+    // Samples for a mixer opened differently are decoded again from the file
+    const ArchiveSound *sound = (const ArchiveSound*)blob;
+    if (sound->frequency != frequency || sound->format != format || sound->channels != channels)
+    {
+        return Mix_LoadWAV(filename);
+    }
+
+    return Mix_QuickLoad_RAW((Uint8*)(blob + sound->samples), sound->length);
+}
+
+// Levels of detail have none of their own, as GenerateMeshLods makes them
+static bool checkMesh(const Uint8 *blob, Uint32 size, const ArchiveMesh *mesh, bool level)
+{
+    if (!fitsInBlob(size, mesh->vertices, mesh->vertexCount, sizeof(Vector4))
+        || !fitsInBlob(size, mesh->indices, mesh->triangleCount, sizeof(int) * 3)
+        || !fitsInBlob(size, mesh->faceNormals, mesh->triangleCount, sizeof(Vector4))
+        || !fitsInBlob(size, mesh->vertexNormals, mesh->vertexCount, sizeof(Vector3))
+        || !fitsInBlob(size, mesh->lods, mesh->lodCount, sizeof(ArchiveMesh))
+        || (level && mesh->lodCount > 0))
+    {
+        return false;
+    }
+
+    const int *indices = (const int*)(blob + mesh->indices);
+    for (Uint32 i = 0; i < mesh->triangleCount * 3; i++) {
+        if (indices[i] < 0 || (Uint32)indices[i] >= mesh->vertexCount) {
+            return false;
+        }
+    }
+
+    const ArchiveMesh *lods = (const ArchiveMesh*)(blob + mesh->lods);
+    for (Uint32 i = 0; i < mesh->lodCount; i++) {
+        if (!checkMesh(blob, size, &lods[i], true)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void mapMesh(Mesh3d *res, const Uint8 *blob, const ArchiveMesh *mesh)
+{
+    memset(res, 0, sizeof(Mesh3d));
+    res->vertices = (Vector4*)(blob + mesh->vertices);
+    res->vertexCount = mesh->vertexCount;
+    res->indices = (int*)(blob + mesh->indices);
+    res->triangleCount = mesh->triangleCount;
+    res->faceNormals = (Vector4*)(blob + mesh->faceNormals);
+    res->vertexNormals = (Vector3*)(blob + mesh->vertexNormals);
+    res->boundsMin = mesh->boundsMin;
+    res->boundsMax = mesh->boundsMax;
+    res->boundsCenter = mesh->boundsCenter;
+    res->boundsRadius = mesh->boundsRadius;
+    res->lodError = mesh->lodError;
+    res->mapped = true;
+
+    if (mesh->lodCount > 0) {
+        const ArchiveMesh *lods = (const ArchiveMesh*)(blob + mesh->lods);
+        res->lods = (Mesh3d*)malloc(sizeof(Mesh3d) * mesh->lodCount);
+        if (res->lods == NULL) {
+            return;
+        }
+        res->lodCount = mesh->lodCount;
+        for (Uint32 i = 0; i < mesh->lodCount; i++) {
+            mapMesh(&res->lods[i], blob, &lods[i]);
+        }
+    }
+}
+
+bool LoadMeshFromArchive(Mesh3d *res, const Archive *archive, const char *filename)
+{
+    Uint32 size;
+    const Uint8 *blob = (const Uint8*)FindArchiveEntry(archive, filename, ARCHIVE_MESH, &size);
+    if (blob == NULL || !fitsInBlob(size, 0, 1, sizeof(ArchiveMesh)) ||
+        !checkMesh(blob, size, (const ArchiveMesh*)blob, false))
+    {
+        return LoadFromObjectFile(res, filename);
+    }
+
+    mapMesh(res, blob, (const ArchiveMesh*)blob);
+    return true;
+}
+
+// Every glyph has to lie within the atlas, which drawing does not check
+static bool checkFont(const Uint8 *blob, Uint32 size)
+{
+    const ArchiveFont *font = (const ArchiveFont*)blob;
+    if (!fitsInBlob(size, 0, 1, sizeof(ArchiveFont)) || font->atlasHeight < 0 ||
+        !fitsInBlob(size, font->atlas, MAX(font->atlasHeight, 1), FONT_ATLAS_WIDTH))
+    {
+        return false;
+    }
+
+    for (int i = 0; i < FONT_GLYPH_COUNT; i++) {
+        const Glyph *glyph = &font->glyphs[i];
+        if (glyph->x < 0 || glyph->y < 0 || glyph->width < 0 || glyph->height < 0 ||
+            glyph->x + glyph->width > FONT_ATLAS_WIDTH || glyph->y + glyph->height > font->atlasHeight) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool LoadFontFromArchive(Font *res, const Archive *archive, const char *filename, int size)
+{
+    char name[ARCHIVE_NAME_LENGTH];
+    snprintf(name, sizeof(name), "%s:%d", filename, size);
+
+    Uint32 blobSize;
+    const Uint8 *blob = (const Uint8*)FindArchiveEntry(archive, name, ARCHIVE_FONT, &blobSize);
+    if (blob == NULL || !checkFont(blob, blobSize))
+    {
+        return LoadFont(res, filename, size);
+    }
+
+    const ArchiveFont *font = (const ArchiveFont*)blob;
+    res->atlas = (Uint8*)(blob + font->atlas);
+    res->atlasHeight = font->atlasHeight;
+    res->lineSkip = font->lineSkip;
+    memcpy(res->glyphs, font->glyphs, sizeof(res->glyphs));
+    memcpy(res->kerning, font->kerning, sizeof(res->kerning));
+    res->mapped = true;
+
+    return true;
+}
@@ -0,0 +1,80 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include "core.h"
+
+// Layout of the asset archives written by tools/packer.c and mapped by
+// LoadArchive. All values are little endian 32-bit words, offsets are in
+// bytes and every blob and array starts ARCHIVE_ALIGN aligned, so that the
+// mapped file can be used as it is.
+#define ARCHIVE_MAGIC 0x314b4150    // "PAK1"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_ALIGN 16
+#define ARCHIVE_NAME_LENGTH 52
+
+#define ARCHIVE_IMAGE 1
+#define ARCHIVE_MESH 2
+#define ARCHIVE_SOUND 3
+#define ARCHIVE_FONT 4
+
+// Followed by `entryCount` entries sorted by name
+typedef struct ArchiveHeader {
+    Uint32 magic;
+    Uint32 version;
+    Uint32 entryCount;
+    Uint32 reserved;
+} ArchiveHeader;
+
+typedef struct ArchiveEntry {
+    char name[ARCHIVE_NAME_LENGTH];     // the asset's path, fonts end in ":size"
+    Uint32 type;                        // ARCHIVE_*
+    Uint32 offset;                      // from the start of the file
+    Uint32 size;
+} ArchiveEntry;
+
+// Offsets within a blob are from the start of the blob
+
+// An SDL surface's pixels: opaque images in the screen format, images with
+// an alpha channel in ARGB8888
+typedef struct ArchiveImage {
+    Uint32 width, height, pitch;
+    Uint32 bitsPerPixel;
+    Uint32 Rmask, Gmask, Bmask, Amask;
+    Uint32 flags;                       // SDL_SRCCOLORKEY and SDL_SRCALPHA
+    Uint32 colorkey;
+    Uint32 pixels;
+} ArchiveImage;
+
+// A Mesh3d with its normals, bounds and levels of detail
+typedef struct ArchiveMesh {
+    Uint32 vertexCount, triangleCount;
+    Uint32 vertices, indices;
+    Uint32 faceNormals, vertexNormals;
+    Vector3 boundsMin, boundsMax;
+    Vector3 boundsCenter;
+    float boundsRadius;
+    float lodError;
+    Uint32 lodCount;
+    Uint32 lods;                        // `lodCount` ArchiveMesh in a row
+} ArchiveMesh;
+
+// Samples already converted to the mixer's format, as Mix_LoadWAV leaves them
+typedef struct ArchiveSound {
+    Sint32 frequency;
+    Uint32 format;
+    Sint32 channels;
+    Uint32 length;
+    Uint32 samples;
+} ArchiveSound;
+
+// A rasterized Font
+typedef struct ArchiveFont {
+    Sint32 size;
+    Sint32 lineSkip;
+    Sint32 atlasHeight;
+    Uint32 atlas;
+    Glyph glyphs[FONT_GLYPH_COUNT];
+    Sint8 kerning[FONT_GLYPH_COUNT][FONT_GLYPH_COUNT];
+} ArchiveFont;
+
+#endif
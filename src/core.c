@@ -1,44 +1,523 @@
 #include "math.h"
+#include <pthread.h>
+#include <unistd.h>
 
 #include "kvec.h"
-#include "deque.h"
 
 #include "core.h"
 #include "matrix.h"
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define RASTER_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define RASTER_SSE
+#endif
+
+// Rasterizer vertex coordinates are fixed point with this many fractional bits
+#define SUBPIXEL_BITS 4
+#define SUBPIXEL_ONE (1 << SUBPIXEL_BITS)
+#define SUBPIXEL_HALF (SUBPIXEL_ONE >> 1)
+
+// Triangles are walked in screen-aligned blocks of RASTER_BLOCK x RASTER_BLOCK pixels
+#define RASTER_BLOCK 8
+
+// Binned rendering splits the screen into tiles of RASTER_TILE x RASTER_TILE
+// pixels which are rasterized in parallel. Must be a multiple of RASTER_BLOCK.
+#define RASTER_TILE 64
+#define RASTER_TILES_X ((SCREEN_WIDTH + RASTER_TILE - 1) / RASTER_TILE)
+#define RASTER_TILES_Y ((SCREEN_HEIGHT + RASTER_TILE - 1) / RASTER_TILE)
+#define RASTER_TILE_COUNT (RASTER_TILES_X * RASTER_TILES_Y)
+
+#define MAX_RASTER_THREADS 8
+
+// Dynamic resolution: render widths step by RENDER_SIZE_STEP pixels between
+// MIN_RENDER_SCALE times the screen size and the full screen. The controller
+// averages frame times over about 1 / FRAME_TIME_SMOOTHING frames, waits
+// RENDER_SIZE_SETTLE frames after every change and leaves frame times within
+// the dead band around the target alone.
+#define RENDER_SIZE_STEP 16
+#define MIN_RENDER_SCALE 0.5f
+#define FRAME_TIME_SMOOTHING 0.1f
+#define RENDER_SIZE_SETTLE 8
+#define FRAME_TIME_SLOW 1.05f
+#define FRAME_TIME_FAST 0.85f
+
+// Dirty rectangles kept per frame before the closest ones get merged
+#define MAX_DIRTY_RECTS 32
+
+// Hierarchical Z keeps depth bounds per RASTER_BLOCK and per RASTER_TILE
+#define DEPTH_BLOCKS_X ((SCREEN_WIDTH + RASTER_BLOCK - 1) / RASTER_BLOCK)
+#define DEPTH_BLOCKS_Y ((SCREEN_HEIGHT + RASTER_BLOCK - 1) / RASTER_BLOCK)
+#define DEPTH_BLOCK_COUNT (DEPTH_BLOCKS_X * DEPTH_BLOCKS_Y)
+
+// Relative bound on the rounding error of an interpolated depth
+#define DEPTH_SLACK (1.0f / 65536.0f)
+
+// Frames that skip the depth clear draw into a depth range this much in front
+// of the previous frame's. 3D depths (-z / w) stay within (-1.0001, 0], 2D
+// pixels are drawn at DEPTH_OVERLAY, in front of them but behind the next range.
+#define DEPTH_RANGE_STEP 2.0f
+#define DEPTH_OVERLAY 0.5f
+#define MAX_DEPTH_CLEAR_INTERVAL 8
+
+// The integer depth formats map depths from DEPTH_CODE_LOW to the top of the
+// last clear interval's range, plus DEPTH_CODE_MARGIN, onto codes 1 to their
+// maximum. Code 0 is left for cleared pixels.
+#define DEPTH_CODE_LOW (-1.0f - DEPTH_CODE_MARGIN)
+#define DEPTH_CODE_MARGIN 0.0625f
+#define DEPTH_CODE_MAX_FIXED16 65535.0f
+#define DEPTH_CODE_MAX_INT24 16777215.0f
+
+// Guard band limits, as multiples of the screen size. Beyond MAX_GUARD_BAND
+// the rasterizer's 32-bit edge functions could overflow.
+#define DEFAULT_GUARD_BAND 2.0f
+#define MAX_GUARD_BAND 3.0f
+// Triangles given in screen coordinates are clipped to MAX_GUARD_BAND, and
+// dropped with a coordinate beyond this, or not a number, which clipping
+// could not handle in floats
+#define MAX_SCREEN_COORDINATE 1e30f
+
+// Clip-space outcodes. The low bits test against the screen edges,
+// the same bits shifted by CLIP_GUARD_SHIFT against the guard band.
+#define CLIP_NEAR   0x01
+#define CLIP_LEFT   0x02
+#define CLIP_RIGHT  0x04
+#define CLIP_BOTTOM 0x08
+#define CLIP_TOP    0x10
+#define CLIP_SCREEN_MASK 0x1F
+#define CLIP_GUARD_SHIFT 5
+
+// Near plane plus four guard band planes can add one vertex each
+#define MAX_CLIP_POLYGON 8
+
+// View frustum planes, in the order of the clip outcodes plus the far plane
+#define FRUSTUM_NEAR 0
+#define FRUSTUM_LEFT 1
+#define FRUSTUM_RIGHT 2
+#define FRUSTUM_BOTTOM 3
+#define FRUSTUM_TOP 4
+#define FRUSTUM_FAR 5
+#define FRUSTUM_PLANES 6
+
+// Results of culling a model against the frustum
+#define CULL_OUTSIDE 0
+#define CULL_INTERSECTS 1
+#define CULL_INSIDE 2
+
+// Textured spans are perspective-correct every TEXTURE_SPAN pixels and
+// interpolated linearly in between
+#define TEXTURE_SPAN 16
+// Texels a span may cross, which keeps its end within 16.16 fixed point
+#define MAX_SPAN_TEXELS 16384.0f
+
+// Smooth shading interpolates gray levels from 0 to SHADE_LEVELS - 1, steeper
+// gradients than MAX_SHADE_GRADIENT levels per pixel are drawn flat instead
+#define SHADE_LEVELS 256
+#define MAX_SHADE_GRADIENT 64.0f
+
+// 16-bit screens can dither with a DITHER_SIZE x DITHER_SIZE ordered pattern,
+// offsetting gray levels by up to SHADE_DITHER_LEVELS. At 32 bits per pixel
+// the patterns shrink to a single entry.
+#if BITS_PER_PIXEL == 16
+#define DITHER_SIZE 4
+#else
+#define DITHER_SIZE 1
+#endif
+#define DITHER_MASK (DITHER_SIZE - 1)
+#define SHADE_DITHER_LEVELS 8
+
+typedef struct RasterEdge {
+    int stepX, stepY;   // change per pixel in x and y
+    int origin;         // value at the center of pixel (0, 0), top-left bias included
+    int blockMin;       // smallest and largest offset from a block's first
+    int blockMax;       // pixel to any of its corners
+} RasterEdge;
+
+// A triangle after setup, ready to be rasterized into any part of the screen
+typedef struct RasterTriangle {
+    RasterEdge edges[3];
+    float zOrigin, dzdx, dzdy;
+    float zMin, zMax;               // depth range of the vertices
+    float zSlack;                   // how far interpolated depths may stray from it
+    int minX, minY, maxX, maxY;     // bounding box in pixels, inclusive
+
+    // Flat color, pixel (x, y) takes pixels[y & DITHER_MASK][x & DITHER_MASK]
+    Pixel pixels[DITHER_SIZE][DITHER_SIZE];
+
+    // Smooth shaded triangles look their color up in `ramp` by an intensity
+    // level, interpolated in 16.16 fixed point. NULL for flat triangles.
+    const Pixel *ramp;
+    float shadeOrigin, dsdx, dsdy;
+} RasterTriangle;
+
+// A DrawModel call recorded in deferred mode
+typedef struct DrawCommand {
+    Mesh3d *mesh;
+    Matrix4 world;
+    float depth;        // view space z of the model's bounding sphere center
+    int order;          // call order, breaks ties between equal depths
+    int visibility;     // CULL_INTERSECTS or CULL_INSIDE
+    int level;          // 0 for the mesh itself, 1 for its first level of detail...
+} DrawCommand;
+
 typedef struct
 {
     SDL_Surface *video;
-    SDL_Surface *screen;
-    float *depthBuffer;
+    SDL_Surface *frame;         // full size frame, platform.video when the formats match
+    SDL_Surface *screen;        // what is drawn to, the frame or a smaller render target
+    bool screenLocked;
+
+    // Below the screen size frames are drawn into `scaled`, a surface over
+    // `scaledPixels`, and scaled up to the full size frame by EndDrawing
+    int renderWidth;
+    int renderHeight;
+    SDL_Surface *scaled;
+    Pixel *scaledPixels;
+
+    // Dynamic resolution: the requested scale, applied by BeginDrawing, and
+    // the controller state, see UpdateRenderScale
+    float renderScale;
+    float targetFrameTime;
+    float frameTimeAverage;
+    int renderSettle;
+
+    // Depth is handled as floats everywhere but in the buffer itself. For
+    // the integer formats these are codes, depth * depthScale + depthOffset,
+    // which the buffer stores truncated. Float depth keeps scale 1, offset 0.
+    void *depthBuffer;
+    int depthFormat;
+    float depthScale;
+    float depthOffset;
+
+    // Hierarchical Z. Every block of the depth buffer has a lower and an
+    // upper bound on the depths stored in it, every tile the lowest of its
+    // blocks' lower bounds. Bounds may be loose but never wrong.
+    float *depthBlockMin;
+    float *depthBlockMax;
+    float *depthTileMin;
+
+    // Offset added to every depth written this frame, see DEPTH_RANGE_STEP
+    float depthBase;
+    int depthFrame;             // frames since the last depth clear
+    int depthClearInterval;
+    bool depthClearPending;     // cleared lazily, or fused with the background
+
+    // SetBackgroundImage's copy, in the screen format
+    SDL_Surface *background;
+
+    // With dirty tracking, the areas drawn since the last present, merged
+    // where they overlap or touch, or the whole frame
+    bool dirtyTracking;
+    bool dirtyAll;
+    int dirtyCount;
+    SDL_Rect dirtyRects[MAX_DIRTY_RECTS];
 } PlatformData;
 
 typedef struct RenderState {
     Matrix4 viewMatrix;
     Matrix4 projMatrix;
+    Matrix4 viewProjMatrix;
     Camera3d camera;
     Vector3 light;
 
-    kvec_t(Triangle3d) trianglesToRaster;
-    kdq_t(Triangle3d) trinaglesDeque;
+    // SHADING_FLAT or SHADING_SMOOTH, and the screen pixel of every gray level
+    // plus one past the brightest, in case interpolation rounds up to it, and
+    // the levels dithering may add on top
+    int shadingMode;
+    Pixel shadeRamp[SHADE_LEVELS + 1 + SHADE_DITHER_LEVELS];
+
+    // Per screen position, the offset added to interpolated gray levels in
+    // 16.16 fixed point. All zero without dithering.
+    bool dithering;
+    Uint32 shadeDither[DITHER_SIZE][DITHER_SIZE];
+
+    // Largest projected error of a level of detail, in pixels
+    float lodErrorBudget;
+
+    // World space frustum planes, normal in xyz and distance in w,
+    // positive on the inside
+    Vector4 frustum[FRUSTUM_PLANES];
+
+    // Per-draw scratch in structure-of-arrays layout: every mesh
+    // vertex is transformed once and the faces index into these
+    float *vertexScratch;
+    int vertexCapacity;
+    float *clipVertices[4];
+    float *screenVertices[3];
+    unsigned short *clipCodes;
+    float *vertexShades;
+
+    // vertexShades still holds this mesh lit from this model space light
+    // direction, so repeated instances of a mesh skip lighting its vertices
+    const Mesh3d *shadedMesh;
+    Vector3 shadedLight;
+
+    // Triangles are only clipped against the screen edges once a vertex
+    // leaves this multiple of the screen, the rasterizer scissors the rest
+    float guardBand;
+
+    // With wireframe on, the edges of the batch's faces as pairs of screen
+    // points, drawn over them in wireColor once they are rasterized
+    bool wireframe;
+    SDL_Color wireColor;
+    kvec_t(Vector4) wireLines;
+
+    // Set up triangles of the current batch and, per screen tile,
+    // the indices of those that touch it in submission order
+    kvec_t(RasterTriangle) rasterTriangles;
+    kvec_t(int) tileBins[RASTER_TILE_COUNT];
+
+    // In deferred mode DrawModel only records commands between BeginMode3d
+    // and EndMode3d, which draws them front to back as a single batch
+    bool deferred;
+    bool mode3d;
+    kvec_t(DrawCommand) drawCommands;
+
+    // DrawSprites' sprites in the order they get drawn
+    kvec_t(const Sprite*) spriteOrder;
 } RenderState;
 
+typedef struct RasterWorkers {
+    pthread_t threads[MAX_RASTER_THREADS];
+    int threadCount;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    int generation;         // bumped for every batch of tiles
+    int busy;               // workers still on the current batch
+    bool quit;
+
+    volatile int nextTile;
+} RasterWorkers;
+
+// 4x4 Bayer matrix, thresholds in sixteenths
+static const int ditherPattern[4][4] = {
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 },
+};
+
 static PlatformData platform = {0};
 static RenderState renderState = {0};
+static RasterWorkers rasterWorkers = {0};
 
 static int currentKeyState[MAX_KEYBOARD_KEYS];
 static int previousKeyState[MAX_KEYBOARD_KEYS];
 static bool windowShouldClose = false;
 
+static void StartRasterWorkers();
+static void StopRasterWorkers();
+static inline void ensureDepthCleared();
+static void flushDrawCommands();
+
+// The screen's pixels may only be touched while it is locked, and SDL's own
+// blits and flips need it unlocked. Only the video surface ever needs locking.
+static inline void lockScreen() {
+    if (!platform.screenLocked && SDL_MUSTLOCK(platform.screen)) {
+        SDL_LockSurface(platform.screen);
+        platform.screenLocked = true;
+    }
+}
+
+static inline void unlockScreen() {
+    if (platform.screenLocked) {
+        SDL_UnlockSurface(platform.screen);
+        platform.screenLocked = false;
+    }
+}
+
+// Records that the rectangle is drawn to this frame, clipped to the render target
+static void markDirty(int x, int y, int width, int height)
+{
+    if (!platform.dirtyTracking || platform.dirtyAll) {
+        return;
+    }
+
+    int x0 = MAX(x, 0), y0 = MAX(y, 0);
+    int x1 = MIN(x + width, platform.renderWidth), y1 = MIN(y + height, platform.renderHeight);
+    if (x0 >= x1 || y0 >= y1) {
+        return;
+    }
+
+    // Absorb every rectangle it overlaps or touches, starting over as it grows
+    for (int i = 0; i < platform.dirtyCount;) {
+        SDL_Rect *r = &platform.dirtyRects[i];
+        if (x0 <= r->x + r->w && r->x <= x1 && y0 <= r->y + r->h && r->y <= y1) {
+            x0 = MIN(x0, r->x);
+            y0 = MIN(y0, r->y);
+            x1 = MAX(x1, r->x + r->w);
+            y1 = MAX(y1, r->y + r->h);
+            *r = platform.dirtyRects[--platform.dirtyCount];
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+
+    if (platform.dirtyCount == MAX_DIRTY_RECTS) {
+        // Out of rectangles: merge with the one that grows the least
+        int best = 0, bestGrowth = SCREEN_WIDTH * SCREEN_HEIGHT + 1;
+        for (int i = 0; i < platform.dirtyCount; i++) {
+            SDL_Rect *r = &platform.dirtyRects[i];
+            int w = MAX(x1, r->x + r->w) - MIN(x0, r->x);
+            int h = MAX(y1, r->y + r->h) - MIN(y0, r->y);
+            int growth = w * h - r->w * r->h;
+            if (growth < bestGrowth) {
+                best = i;
+                bestGrowth = growth;
+            }
+        }
+        SDL_Rect r = platform.dirtyRects[best];
+        platform.dirtyRects[best] = platform.dirtyRects[--platform.dirtyCount];
+        int mx = MIN(x0, r.x), my = MIN(y0, r.y);
+        markDirty(mx, my, MAX(x1, r.x + r.w) - mx, MAX(y1, r.y + r.h) - my);
+        return;
+    }
+
+    platform.dirtyRects[platform.dirtyCount++] = (SDL_Rect){ (Sint16)x0, (Sint16)y0, (Uint16)(x1 - x0), (Uint16)(y1 - y0) };
+}
+
+static inline void markDirtyAll()
+{
+    platform.dirtyAll = true;
+}
+
+// 2D drawing is placed in screen pixels and shrinks with the frame, so that
+// it ends up in the same place and size at every render scale. These are
+// screen coordinates in render pixels, rounded down.
+static inline int toRenderX(int x)
+{
+    Sint64 scaled = (Sint64)x * platform.renderWidth;
+    return (int)(scaled >= 0 ? scaled / SCREEN_WIDTH : -((-scaled + SCREEN_WIDTH - 1) / SCREEN_WIDTH));
+}
+
+static inline int toRenderY(int y)
+{
+    Sint64 scaled = (Sint64)y * platform.renderHeight;
+    return (int)(scaled >= 0 ? scaled / SCREEN_HEIGHT : -((-scaled + SCREEN_HEIGHT - 1) / SCREEN_HEIGHT));
+}
+
 SDL_Surface* Platform_GetScreenSurface() {
+    flushDrawCommands();
+    lockScreen();
+    // Whatever is drawn through it is not tracked
+    markDirtyAll();
     return platform.screen;
 }
 
-float *Platform_GetDepthBuffer() {
+SDL_PixelFormat* Platform_GetScreenFormat() {
+    return platform.screen->format;
+}
+
+void *Platform_GetDepthBuffer() {
+    flushDrawCommands();
+    ensureDepthCleared();
     return platform.depthBuffer;
 }
 
+int Platform_GetDepthFormat() {
+    return platform.depthFormat;
+}
+
+static inline int depthBytes(int format) {
+    return format == DEPTH_FORMAT_FIXED16 ? sizeof(Uint16) : sizeof(Uint32);
+}
+
+// Depth buffer row `y`, in the current format. Rows are packed at the render width.
+static inline void *depthRowAt(int y, int format) {
+    return (Uint8*)platform.depthBuffer + y * platform.renderWidth * depthBytes(format);
+}
+
+// Depth, offset by depthBase already, in the units the buffer compares
+static inline float encodeDepth(float z) {
+    return z * platform.depthScale + platform.depthOffset;
+}
+
+// Fits the integer codes to the depth ranges of the clear interval
+static void updateDepthEncoding() {
+    float codeMax;
+    switch (platform.depthFormat) {
+    case DEPTH_FORMAT_FIXED16: codeMax = DEPTH_CODE_MAX_FIXED16; break;
+    case DEPTH_FORMAT_INT24: codeMax = DEPTH_CODE_MAX_INT24; break;
+    default:
+        platform.depthScale = 1.0f;
+        platform.depthOffset = 0.0f;
+        return;
+    }
+
+    float high = (platform.depthClearInterval - 1) * DEPTH_RANGE_STEP + DEPTH_OVERLAY + DEPTH_CODE_MARGIN;
+    platform.depthScale = (codeMax - 1.0f) / (high - DEPTH_CODE_LOW);
+    platform.depthOffset = 1.0f - DEPTH_CODE_LOW * platform.depthScale;
+}
+
+// Rebuilds the shade ramp and the dither offsets for the screen format
+static void updateDithering() {
+    const SDL_PixelFormat *format = platform.screen->format;
+    bool dither = renderState.dithering && DITHER_SIZE > 1;
+
+    // Offsets span one step of the coarsest channel. Finer channels are
+    // shifted down by half the difference so they stay centered.
+    int step = MIN(1 << MAX(format->Rloss, MAX(format->Gloss, format->Bloss)), SHADE_DITHER_LEVELS);
+    for (int y = 0; y < DITHER_SIZE; y++) {
+        for (int x = 0; x < DITHER_SIZE; x++) {
+            renderState.shadeDither[y][x] = dither ? ditherPattern[y][x] * step * 65536 / 16 : 0;
+        }
+    }
+
+    for (int i = 0; i < SHADE_LEVELS + 1 + SHADE_DITHER_LEVELS; i++) {
+        int level = MIN(i, SHADE_LEVELS - 1);
+        int r = level, g = level, b = level;
+        if (dither) {
+            r = MAX(level - (step - (1 << format->Rloss)) / 2, 0);
+            g = MAX(level - (step - (1 << format->Gloss)) / 2, 0);
+            b = MAX(level - (step - (1 << format->Bloss)) / 2, 0);
+        }
+        renderState.shadeRamp[i] = SDL_MapRGB(format, r, g, b);
+    }
+}
+
+// Sets up the video surface, or replaces it with one with other flags
+static void setVideoMode(Uint32 flags)
+{
+    unlockScreen();
+    bool direct = platform.frame == NULL || platform.frame == platform.video;
+
+    platform.video = SDL_SetVideoMode(
+        SCREEN_WIDTH,
+        SCREEN_HEIGHT,
+        BITS_PER_PIXEL,
+        flags);
+
+    // Draw straight into the video surface when we can, or into a surface
+    // of our own that EndDrawing converts and copies
+    if (direct) {
+        if (platform.video->format->BitsPerPixel == BITS_PER_PIXEL) {
+            platform.frame = platform.video;
+        } else {
+            platform.frame = SDL_CreateRGBSurface(
+                SDL_HWSURFACE,
+                SCREEN_WIDTH,
+                SCREEN_HEIGHT,
+                BITS_PER_PIXEL,
+                0, 0, 0, 0);
+        }
+    }
+    if (platform.scaled == NULL) {
+        platform.screen = platform.frame;
+    }
+    markDirtyAll();
+}
+
 int InitWindow()
+{
+    return InitWindowEx(DEPTH_FORMAT_FLOAT32);
+}
+
+int InitWindowEx(int depthFormat)
 {
     SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
     IMG_Init(IMG_INIT_PNG);
@@ -51,38 +530,63 @@ int InitWindow()
             AUDIO_CHUNK_SIZE
     );
 
-    platform.video = SDL_SetVideoMode(
-        SCREEN_WIDTH,
-        SCREEN_HEIGHT,
-        BITS_PER_PIXEL,
-        SDL_HWSURFACE | SDL_DOUBLEBUF);
-
-    platform.screen = SDL_CreateRGBSurface(
-        SDL_HWSURFACE,
-        SCREEN_WIDTH,
-        SCREEN_HEIGHT,
-        BITS_PER_PIXEL,
-        0, 0, 0, 0);
+    setVideoMode(SDL_HWSURFACE | SDL_DOUBLEBUF);
+    platform.renderWidth = SCREEN_WIDTH;
+    platform.renderHeight = SCREEN_HEIGHT;
+    platform.renderScale = 1.0f;
 
-    platform.depthBuffer = (float*)malloc(sizeof(float) * SCREEN_HEIGHT * SCREEN_WIDTH);
-    // for (int i = 0; i < SCREEN_HEIGHT * SCREEN_WIDTH; i++) {
-    //     platform.depthBuffer[i] = 0.0f;
-    // }
+    platform.depthFormat = CLAMP(depthFormat, DEPTH_FORMAT_FLOAT32, DEPTH_FORMAT_INT24);
+    platform.depthBuffer = malloc(depthBytes(platform.depthFormat) * SCREEN_HEIGHT * SCREEN_WIDTH);
+    platform.depthBlockMin = (float*)malloc(sizeof(float) * DEPTH_BLOCK_COUNT);
+    platform.depthBlockMax = (float*)malloc(sizeof(float) * DEPTH_BLOCK_COUNT);
+    platform.depthTileMin = (float*)malloc(sizeof(float) * RASTER_TILE_COUNT);
+    platform.depthClearInterval = 1;
+    updateDepthEncoding();
 
     // TODO: move it to separate 3D initialization?
-    kv_init(renderState.trianglesToRaster);
-    kdq_init(renderState.trinaglesDeque);
+    renderState.guardBand = DEFAULT_GUARD_BAND;
+    renderState.deferred = true;
+    renderState.lodErrorBudget = 1.0f;
+    renderState.shadingMode = SHADING_FLAT;
+    updateDithering();
+
+    kv_init(renderState.drawCommands);
+    kv_init(renderState.spriteOrder);
+    kv_init(renderState.rasterTriangles);
+    kv_init(renderState.wireLines);
+    for (int i = 0; i < RASTER_TILE_COUNT; i++) {
+        kv_init(renderState.tileBins[i]);
+    }
+    StartRasterWorkers();
 
     return 0;
 }
 
 int CloseWindow()
 {
-    kdq_destroy(renderState.trinaglesDeque);
-    kv_destroy(renderState.trianglesToRaster);
+    StopRasterWorkers();
+    for (int i = 0; i < RASTER_TILE_COUNT; i++) {
+        kv_destroy(renderState.tileBins[i]);
+    }
+    kv_destroy(renderState.rasterTriangles);
+    kv_destroy(renderState.wireLines);
+    kv_destroy(renderState.drawCommands);
+    kv_destroy(renderState.spriteOrder);
+
+    free(renderState.vertexScratch);
+    SDL_FreeSurface(platform.background);
+
+    free(platform.depthTileMin);
+    free(platform.depthBlockMax);
+    free(platform.depthBlockMin);
     free(platform.depthBuffer);
 
-    SDL_FreeSurface(platform.screen);
+    unlockScreen();
+    SDL_FreeSurface(platform.scaled);
+    free(platform.scaledPixels);
+    if (platform.frame != platform.video) {
+        SDL_FreeSurface(platform.frame);
+    }
     SDL_FreeSurface(platform.video);
 
     Mix_Quit();
@@ -156,386 +660,2191 @@ void PollInputEvents()
     }
 }
 
-int BeginDrawing()
+// Vectors of 16 bytes of pixels: 4 at 32 bits per pixel, 8 at 16. The
+// helpers below write the first 4 or all 8 pixels of one, repeated twice at
+// 32 bits, either all of them or those whose lane in `nearer` is set.
+#define PIXEL_LANES (16 / (int)sizeof(Pixel))
+
+#if defined(RASTER_NEON)
+#if BITS_PER_PIXEL == 16
+typedef uint16x8_t PixelVector;
+static inline PixelVector splatPixel(Pixel pixel) { return vdupq_n_u16(pixel); }
+static inline PixelVector loadPixels(const Pixel *pixels) { return vld1q_u16(pixels); }
+static inline void storePixels(Pixel *pixels, PixelVector v) { vst1q_u16(pixels, v); }
+
+static inline void storePixels4(Pixel *row, PixelVector colors) {
+    vst1_u16(row, vget_low_u16(colors));
+}
+static inline void blendPixels4(Pixel *row, uint32x4_t nearer, PixelVector colors) {
+    vst1_u16(row, vbsl_u16(vmovn_u32(nearer), vget_low_u16(colors), vld1_u16(row)));
+}
+static inline void storePixels8(Pixel *row, PixelVector colors) {
+    vst1q_u16(row, colors);
+}
+static inline void blendPixels8(Pixel *row, uint16x8_t nearer, PixelVector colors) {
+    vst1q_u16(row, vbslq_u16(nearer, colors, vld1q_u16(row)));
+}
+#else
+typedef uint32x4_t PixelVector;
+static inline PixelVector splatPixel(Pixel pixel) { return vdupq_n_u32(pixel); }
+static inline PixelVector loadPixels(const Pixel *pixels) { return vld1q_u32(pixels); }
+static inline void storePixels(Pixel *pixels, PixelVector v) { vst1q_u32(pixels, v); }
+
+static inline void storePixels4(Pixel *row, PixelVector colors) {
+    vst1q_u32(row, colors);
+}
+static inline void blendPixels4(Pixel *row, uint32x4_t nearer, PixelVector colors) {
+    vst1q_u32(row, vbslq_u32(nearer, colors, vld1q_u32(row)));
+}
+static inline void storePixels8(Pixel *row, PixelVector colors) {
+    vst1q_u32(row, colors);
+    vst1q_u32(row + 4, colors);
+}
+static inline void blendPixels8(Pixel *row, uint16x8_t nearer, PixelVector colors) {
+    // Widened to one mask per pixel
+    uint32x4_t nearer0 = vmovl_u16(vget_low_u16(nearer));
+    uint32x4_t nearer1 = vmovl_u16(vget_high_u16(nearer));
+    nearer0 = vorrq_u32(nearer0, vshlq_n_u32(nearer0, 16));
+    nearer1 = vorrq_u32(nearer1, vshlq_n_u32(nearer1, 16));
+    vst1q_u32(row, vbslq_u32(nearer0, colors, vld1q_u32(row)));
+    vst1q_u32(row + 4, vbslq_u32(nearer1, colors, vld1q_u32(row + 4)));
+}
+#endif
+#elif defined(RASTER_SSE)
+typedef __m128i PixelVector;
+static inline PixelVector loadPixels(const Pixel *pixels) { return _mm_loadu_si128((const __m128i*)pixels); }
+static inline void storePixels(Pixel *pixels, PixelVector v) { _mm_storeu_si128((__m128i*)pixels, v); }
+
+static inline __m128i selectBits(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+#if BITS_PER_PIXEL == 16
+static inline PixelVector splatPixel(Pixel pixel) { return _mm_set1_epi16((short)pixel); }
+
+static inline void storePixels4(Pixel *row, PixelVector colors) {
+    _mm_storel_epi64((__m128i*)row, colors);
+}
+static inline void blendPixels4(Pixel *row, __m128i nearer, PixelVector colors) {
+    // Narrowed to one mask per pixel, all bits set or clear survive the saturation
+    __m128i mask = _mm_packs_epi32(nearer, nearer);
+    _mm_storel_epi64((__m128i*)row, selectBits(mask, colors, _mm_loadl_epi64((__m128i*)row)));
+}
+static inline void storePixels8(Pixel *row, PixelVector colors) {
+    storePixels(row, colors);
+}
+static inline void blendPixels8(Pixel *row, __m128i nearer, PixelVector colors) {
+    storePixels(row, selectBits(nearer, colors, loadPixels(row)));
+}
+#else
+static inline PixelVector splatPixel(Pixel pixel) { return _mm_set1_epi32((int)pixel); }
+
+static inline void storePixels4(Pixel *row, PixelVector colors) {
+    storePixels(row, colors);
+}
+static inline void blendPixels4(Pixel *row, __m128i nearer, PixelVector colors) {
+    storePixels(row, selectBits(nearer, colors, loadPixels(row)));
+}
+static inline void storePixels8(Pixel *row, PixelVector colors) {
+    storePixels(row, colors);
+    storePixels(row + 4, colors);
+}
+static inline void blendPixels8(Pixel *row, __m128i nearer, PixelVector colors) {
+    // Widened to one mask per pixel
+    __m128i nearer0 = _mm_unpacklo_epi16(nearer, nearer);
+    __m128i nearer1 = _mm_unpackhi_epi16(nearer, nearer);
+    storePixels(row, selectBits(nearer0, colors, loadPixels(row)));
+    storePixels(row + 4, selectBits(nearer1, colors, loadPixels(row + 4)));
+}
+#endif
+#endif
+
+#if defined(RASTER_NEON) || defined(RASTER_SSE)
+// A row of a dither pattern repeated across a vector, starting at pixel x.
+// Any step by a multiple of 4 pixels keeps it lined up.
+static inline PixelVector patternPixels(const Pixel *pattern, int x)
+{
+#if DITHER_SIZE > 1
+    Pixel lanes[PIXEL_LANES];
+    for (int k = 0; k < PIXEL_LANES; k++) {
+        lanes[k] = pattern[(x + k) & DITHER_MASK];
+    }
+    return loadPixels(lanes);
+#else
+    (void)x;
+    return splatPixel(pattern[0]);
+#endif
+}
+#endif
+
+static void fillPixels(Pixel *pixels, int count, Pixel pixel)
+{
+    int i = 0;
+#if defined(RASTER_NEON) || defined(RASTER_SSE)
+    PixelVector v = splatPixel(pixel);
+    for (; i + 2 * PIXEL_LANES <= count; i += 2 * PIXEL_LANES) {
+        storePixels(pixels + i, v);
+        storePixels(pixels + i + PIXEL_LANES, v);
+    }
+#endif
+    for (; i < count; i++) {
+        pixels[i] = pixel;
+    }
+}
+
+static void fillDepth(float *depth, int count, float z)
+{
+    int i = 0;
+#if defined(RASTER_NEON)
+    float32x4_t v = vdupq_n_f32(z);
+    for (; i + 8 <= count; i += 8) {
+        vst1q_f32(depth + i, v);
+        vst1q_f32(depth + i + 4, v);
+    }
+#elif defined(RASTER_SSE)
+    __m128 v = _mm_set1_ps(z);
+    for (; i + 8 <= count; i += 8) {
+        _mm_storeu_ps(depth + i, v);
+        _mm_storeu_ps(depth + i + 4, v);
+    }
+#endif
+    for (; i < count; i++) {
+        depth[i] = z;
+    }
+}
+
+// Span primitives for the rasterizer: pixels [x0, x1) of a row get the colors
+// of `pattern`, a row of a triangle's dither pattern, and depths interpolated
+// from `z` at x0 by `dzdx` per pixel. The range is not checked, callers have
+// clipped it already. One version per depth format, fillSpan and
+// fillSpanDepthTest pick the right one.
+
+// Writes every pixel of the span
+static inline void fillSpanFloat32(Pixel *row, float *depthRow, int x0, int x1, float z, float dzdx, const Pixel *pattern)
+{
+    row += x0;
+    depthRow += x0;
+    int count = x1 - x0;
+    int i = 0;
+#if defined(RASTER_NEON)
+    const float lanes[4] = { 0.0f, 1.0f, 2.0f, 3.0f };
+    float32x4_t vi = vld1q_f32(lanes);
+    float32x4_t vz = vdupq_n_f32(z);
+    PixelVector vp = patternPixels(pattern, x0);
+    for (; i + 4 <= count; i += 4) {
+        storePixels4(row + i, vp);
+        vst1q_f32(depthRow + i, vaddq_f32(vz, vmulq_n_f32(vi, dzdx)));
+        vi = vaddq_f32(vi, vdupq_n_f32(4.0f));
+    }
+#elif defined(RASTER_SSE)
+    __m128 vi = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+    __m128 vz = _mm_set1_ps(z);
+    __m128 vd = _mm_set1_ps(dzdx);
+    PixelVector vp = patternPixels(pattern, x0);
+    for (; i + 4 <= count; i += 4) {
+        storePixels4(row + i, vp);
+        _mm_storeu_ps(depthRow + i, _mm_add_ps(vz, _mm_mul_ps(vi, vd)));
+        vi = _mm_add_ps(vi, _mm_set1_ps(4.0f));
+    }
+#endif
+    for (; i < count; i++) {
+        row[i] = pattern[(x0 + i) & DITHER_MASK];
+        depthRow[i] = z + (float)i * dzdx;
+    }
+}
+
+// Writes the pixels of the span that are nearer than the depth buffer
+static inline void fillSpanDepthTestFloat32(Pixel *row, float *depthRow, int x0, int x1, float z, float dzdx, const Pixel *pattern)
+{
+    row += x0;
+    depthRow += x0;
+    int count = x1 - x0;
+    int i = 0;
+#if defined(RASTER_NEON)
+    const float lanes[4] = { 0.0f, 1.0f, 2.0f, 3.0f };
+    float32x4_t vi = vld1q_f32(lanes);
+    float32x4_t vz = vdupq_n_f32(z);
+    PixelVector vp = patternPixels(pattern, x0);
+    for (; i + 4 <= count; i += 4) {
+        float32x4_t zs = vaddq_f32(vz, vmulq_n_f32(vi, dzdx));
+        float32x4_t old = vld1q_f32(depthRow + i);
+        uint32x4_t nearer = vcgtq_f32(zs, old);
+        vst1q_f32(depthRow + i, vbslq_f32(nearer, zs, old));
+        blendPixels4(row + i, nearer, vp);
+        vi = vaddq_f32(vi, vdupq_n_f32(4.0f));
+    }
+#elif defined(RASTER_SSE)
+    __m128 vi = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+    __m128 vz = _mm_set1_ps(z);
+    __m128 vd = _mm_set1_ps(dzdx);
+    PixelVector vp = patternPixels(pattern, x0);
+    for (; i + 4 <= count; i += 4) {
+        __m128 zs = _mm_add_ps(vz, _mm_mul_ps(vi, vd));
+        __m128 old = _mm_loadu_ps(depthRow + i);
+        __m128 nearer = _mm_cmpgt_ps(zs, old);
+        _mm_storeu_ps(depthRow + i, _mm_or_ps(_mm_and_ps(nearer, zs), _mm_andnot_ps(nearer, old)));
+        blendPixels4(row + i, _mm_castps_si128(nearer), vp);
+        vi = _mm_add_ps(vi, _mm_set1_ps(4.0f));
+    }
+#endif
+    for (; i < count; i++) {
+        float zi = z + (float)i * dzdx;
+        if (zi > depthRow[i]) {
+            row[i] = pattern[(x0 + i) & DITHER_MASK];
+            depthRow[i] = zi;
+        }
+    }
+}
+
+// Integer depth codes, truncated. Depths that round outside the code range
+// are clamped, cleared pixels (code 0) stay behind everything.
+static inline Uint16 depthCodeFixed16(float z) {
+    return (Uint16)CLAMP(z, 1.0f, DEPTH_CODE_MAX_FIXED16);
+}
+
+static inline Uint32 depthCodeInt24(float z) {
+    return (Uint32)CLAMP(z, 1.0f, DEPTH_CODE_MAX_INT24);
+}
+
+#if defined(RASTER_SSE)
+// Codes of 8 depths from z + i * dzdx, as signed 16-bit values biased by
+// -32768 since SSE2 only compares and packs signed words
+static inline __m128i depthCodesFixed16Biased(__m128 z, __m128 dzdx, __m128 lanes)
+{
+    const __m128 low = _mm_set1_ps(1.0f), high = _mm_set1_ps(DEPTH_CODE_MAX_FIXED16);
+    const __m128i bias = _mm_set1_epi32(32768);
+    __m128 z0 = _mm_add_ps(z, _mm_mul_ps(lanes, dzdx));
+    __m128 z1 = _mm_add_ps(z0, _mm_mul_ps(_mm_set1_ps(4.0f), dzdx));
+    __m128i c0 = _mm_sub_epi32(_mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(z0, low), high)), bias);
+    __m128i c1 = _mm_sub_epi32(_mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(z1, low), high)), bias);
+    return _mm_packs_epi32(c0, c1);
+}
+#endif
+
+static inline void fillSpanFixed16(Pixel *row, Uint16 *depthRow, int x0, int x1, float z, float dzdx, const Pixel *pattern)
+{
+    row += x0;
+    depthRow += x0;
+    int count = x1 - x0;
+    int i = 0;
+#if defined(RASTER_NEON)
+    const float lanes[4] = { 0.0f, 1.0f, 2.0f, 3.0f };
+    float32x4_t vi = vld1q_f32(lanes);
+    float32x4_t vz = vdupq_n_f32(z);
+    float32x4_t low = vdupq_n_f32(1.0f), high = vdupq_n_f32(DEPTH_CODE_MAX_FIXED16);
+    PixelVector vp = patternPixels(pattern, x0);
+    for (; i + 8 <= count; i += 8) {
+        float32x4_t z0 = vaddq_f32(vz, vmulq_n_f32(vi, dzdx));
+        float32x4_t z1 = vaddq_f32(z0, vdupq_n_f32(4.0f * dzdx));
+        uint16x4_t c0 = vmovn_u32(vcvtq_u32_f32(vminq_f32(vmaxq_f32(z0, low), high)));
+        uint16x4_t c1 = vmovn_u32(vcvtq_u32_f32(vminq_f32(vmaxq_f32(z1, low), high)));
+        vst1q_u16(depthRow + i, vcombine_u16(c0, c1));
+        storePixels8(row + i, vp);
+        vi = vaddq_f32(vi, vdupq_n_f32(8.0f));
+    }
+#elif defined(RASTER_SSE)
+    __m128 vi = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+    __m128 vz = _mm_set1_ps(z);
+    __m128 vd = _mm_set1_ps(dzdx);
+    PixelVector vp = patternPixels(pattern, x0);
+    const __m128i unbias = _mm_set1_epi16((short)0x8000);
+    for (; i + 8 <= count; i += 8) {
+        __m128i codes = _mm_xor_si128(depthCodesFixed16Biased(vz, vd, vi), unbias);
+        _mm_storeu_si128((__m128i*)(depthRow + i), codes);
+        storePixels8(row + i, vp);
+        vi = _mm_add_ps(vi, _mm_set1_ps(8.0f));
+    }
+#endif
+    for (; i < count; i++) {
+        row[i] = pattern[(x0 + i) & DITHER_MASK];
+        depthRow[i] = depthCodeFixed16(z + (float)i * dzdx);
+    }
+}
+
+static inline void fillSpanDepthTestFixed16(Pixel *row, Uint16 *depthRow, int x0, int x1, float z, float dzdx, const Pixel *pattern)
+{
+    row += x0;
+    depthRow += x0;
+    int count = x1 - x0;
+    int i = 0;
+#if defined(RASTER_NEON)
+    const float lanes[4] = { 0.0f, 1.0f, 2.0f, 3.0f };
+    float32x4_t vi = vld1q_f32(lanes);
+    float32x4_t vz = vdupq_n_f32(z);
+    float32x4_t low = vdupq_n_f32(1.0f), high = vdupq_n_f32(DEPTH_CODE_MAX_FIXED16);
+    PixelVector vp = patternPixels(pattern, x0);
+    for (; i + 8 <= count; i += 8) {
+        float32x4_t z0 = vaddq_f32(vz, vmulq_n_f32(vi, dzdx));
+        float32x4_t z1 = vaddq_f32(z0, vdupq_n_f32(4.0f * dzdx));
+        uint16x4_t c0 = vmovn_u32(vcvtq_u32_f32(vminq_f32(vmaxq_f32(z0, low), high)));
+        uint16x4_t c1 = vmovn_u32(vcvtq_u32_f32(vminq_f32(vmaxq_f32(z1, low), high)));
+        uint16x8_t codes = vcombine_u16(c0, c1);
+        uint16x8_t old = vld1q_u16(depthRow + i);
+        uint16x8_t nearer = vcgtq_u16(codes, old);
+        vst1q_u16(depthRow + i, vbslq_u16(nearer, codes, old));
+        blendPixels8(row + i, nearer, vp);
+        vi = vaddq_f32(vi, vdupq_n_f32(8.0f));
+    }
+#elif defined(RASTER_SSE)
+    __m128 vi = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+    __m128 vz = _mm_set1_ps(z);
+    __m128 vd = _mm_set1_ps(dzdx);
+    PixelVector vp = patternPixels(pattern, x0);
+    const __m128i unbias = _mm_set1_epi16((short)0x8000);
+    for (; i + 8 <= count; i += 8) {
+        __m128i codes = depthCodesFixed16Biased(vz, vd, vi);
+        __m128i old = _mm_loadu_si128((__m128i*)(depthRow + i));
+        __m128i nearer = _mm_cmpgt_epi16(codes, _mm_xor_si128(old, unbias));
+        codes = _mm_xor_si128(codes, unbias);
+        _mm_storeu_si128((__m128i*)(depthRow + i), selectBits(nearer, codes, old));
+        blendPixels8(row + i, nearer, vp);
+        vi = _mm_add_ps(vi, _mm_set1_ps(8.0f));
+    }
+#endif
+    for (; i < count; i++) {
+        Uint16 code = depthCodeFixed16(z + (float)i * dzdx);
+        if (code > depthRow[i]) {
+            row[i] = pattern[(x0 + i) & DITHER_MASK];
+            depthRow[i] = code;
+        }
+    }
+}
+
+static inline void fillSpanInt24(Pixel *row, Uint32 *depthRow, int x0, int x1, float z, float dzdx, const Pixel *pattern)
+{
+    row += x0;
+    depthRow += x0;
+    int count = x1 - x0;
+    int i = 0;
+#if defined(RASTER_NEON)
+    const float lanes[4] = { 0.0f, 1.0f, 2.0f, 3.0f };
+    float32x4_t vi = vld1q_f32(lanes);
+    float32x4_t vz = vdupq_n_f32(z);
+    float32x4_t low = vdupq_n_f32(1.0f), high = vdupq_n_f32(DEPTH_CODE_MAX_INT24);
+    PixelVector vp = patternPixels(pattern, x0);
+    for (; i + 4 <= count; i += 4) {
+        float32x4_t zs = vaddq_f32(vz, vmulq_n_f32(vi, dzdx));
+        vst1q_u32(depthRow + i, vcvtq_u32_f32(vminq_f32(vmaxq_f32(zs, low), high)));
+        storePixels4(row + i, vp);
+        vi = vaddq_f32(vi, vdupq_n_f32(4.0f));
+    }
+#elif defined(RASTER_SSE)
+    __m128 vi = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+    __m128 vz = _mm_set1_ps(z);
+    __m128 vd = _mm_set1_ps(dzdx);
+    __m128 low = _mm_set1_ps(1.0f), high = _mm_set1_ps(DEPTH_CODE_MAX_INT24);
+    PixelVector vp = patternPixels(pattern, x0);
+    for (; i + 4 <= count; i += 4) {
+        __m128 zs = _mm_add_ps(vz, _mm_mul_ps(vi, vd));
+        _mm_storeu_si128((__m128i*)(depthRow + i), _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(zs, low), high)));
+        storePixels4(row + i, vp);
+        vi = _mm_add_ps(vi, _mm_set1_ps(4.0f));
+    }
+#endif
+    for (; i < count; i++) {
+        row[i] = pattern[(x0 + i) & DITHER_MASK];
+        depthRow[i] = depthCodeInt24(z + (float)i * dzdx);
+    }
+}
+
+static inline void fillSpanDepthTestInt24(Pixel *row, Uint32 *depthRow, int x0, int x1, float z, float dzdx, const Pixel *pattern)
+{
+    row += x0;
+    depthRow += x0;
+    int count = x1 - x0;
+    int i = 0;
+#if defined(RASTER_NEON)
+    const float lanes[4] = { 0.0f, 1.0f, 2.0f, 3.0f };
+    float32x4_t vi = vld1q_f32(lanes);
+    float32x4_t vz = vdupq_n_f32(z);
+    float32x4_t low = vdupq_n_f32(1.0f), high = vdupq_n_f32(DEPTH_CODE_MAX_INT24);
+    PixelVector vp = patternPixels(pattern, x0);
+    for (; i + 4 <= count; i += 4) {
+        float32x4_t zs = vaddq_f32(vz, vmulq_n_f32(vi, dzdx));
+        uint32x4_t codes = vcvtq_u32_f32(vminq_f32(vmaxq_f32(zs, low), high));
+        uint32x4_t old = vld1q_u32(depthRow + i);
+        uint32x4_t nearer = vcgtq_u32(codes, old);
+        vst1q_u32(depthRow + i, vbslq_u32(nearer, codes, old));
+        blendPixels4(row + i, nearer, vp);
+        vi = vaddq_f32(vi, vdupq_n_f32(4.0f));
+    }
+#elif defined(RASTER_SSE)
+    __m128 vi = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+    __m128 vz = _mm_set1_ps(z);
+    __m128 vd = _mm_set1_ps(dzdx);
+    __m128 low = _mm_set1_ps(1.0f), high = _mm_set1_ps(DEPTH_CODE_MAX_INT24);
+    PixelVector vp = patternPixels(pattern, x0);
+    for (; i + 4 <= count; i += 4) {
+        __m128 zs = _mm_add_ps(vz, _mm_mul_ps(vi, vd));
+        __m128i codes = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(zs, low), high));
+        __m128i old = _mm_loadu_si128((__m128i*)(depthRow + i));
+        // Codes stay below 2^24, so the signed compare is fine
+        __m128i nearer = _mm_cmpgt_epi32(codes, old);
+        _mm_storeu_si128((__m128i*)(depthRow + i), selectBits(nearer, codes, old));
+        blendPixels4(row + i, nearer, vp);
+        vi = _mm_add_ps(vi, _mm_set1_ps(4.0f));
+    }
+#endif
+    for (; i < count; i++) {
+        Uint32 code = depthCodeInt24(z + (float)i * dzdx);
+        if (code > depthRow[i]) {
+            row[i] = pattern[(x0 + i) & DITHER_MASK];
+            depthRow[i] = code;
+        }
+    }
+}
+
+// `format` is a constant wherever these are inlined, so the switches fold away
+static inline __attribute__((always_inline)) void fillSpan(
+    Pixel *row, void *depthRow, int x0, int x1, float z, float dzdx, const Pixel *pattern, int format)
+{
+    switch (format) {
+    case DEPTH_FORMAT_FIXED16: fillSpanFixed16(row, (Uint16*)depthRow, x0, x1, z, dzdx, pattern); break;
+    case DEPTH_FORMAT_INT24: fillSpanInt24(row, (Uint32*)depthRow, x0, x1, z, dzdx, pattern); break;
+    default: fillSpanFloat32(row, (float*)depthRow, x0, x1, z, dzdx, pattern); break;
+    }
+}
+
+static inline __attribute__((always_inline)) void fillSpanDepthTest(
+    Pixel *row, void *depthRow, int x0, int x1, float z, float dzdx, const Pixel *pattern, int format)
+{
+    switch (format) {
+    case DEPTH_FORMAT_FIXED16: fillSpanDepthTestFixed16(row, (Uint16*)depthRow, x0, x1, z, dzdx, pattern); break;
+    case DEPTH_FORMAT_INT24: fillSpanDepthTestInt24(row, (Uint32*)depthRow, x0, x1, z, dzdx, pattern); break;
+    default: fillSpanDepthTestFloat32(row, (float*)depthRow, x0, x1, z, dzdx, pattern); break;
+    }
+}
+
+// Single pixel versions for the per-pixel loops
+static inline __attribute__((always_inline)) void writeDepth(void *depthRow, int x, float z, int format)
+{
+    switch (format) {
+    case DEPTH_FORMAT_FIXED16: ((Uint16*)depthRow)[x] = depthCodeFixed16(z); break;
+    case DEPTH_FORMAT_INT24: ((Uint32*)depthRow)[x] = depthCodeInt24(z); break;
+    default: ((float*)depthRow)[x] = z; break;
+    }
+}
+
+// Writes `z` and returns true when it is nearer than the stored depth
+static inline __attribute__((always_inline)) bool testWriteDepth(void *depthRow, int x, float z, int format)
+{
+    switch (format) {
+    case DEPTH_FORMAT_FIXED16: {
+        Uint16 code = depthCodeFixed16(z);
+        if (code <= ((Uint16*)depthRow)[x]) return false;
+        ((Uint16*)depthRow)[x] = code;
+        return true;
+    }
+    case DEPTH_FORMAT_INT24: {
+        Uint32 code = depthCodeInt24(z);
+        if (code <= ((Uint32*)depthRow)[x]) return false;
+        ((Uint32*)depthRow)[x] = code;
+        return true;
+    }
+    default:
+        if (z <= ((float*)depthRow)[x]) return false;
+        ((float*)depthRow)[x] = z;
+        return true;
+    }
+}
+
+// Clears `count` rows of the depth buffer from row `y`
+static void clearDepthRows(int y, int count)
+{
+    if (platform.depthFormat == DEPTH_FORMAT_FLOAT32) {
+        fillDepth((float*)depthRowAt(y, DEPTH_FORMAT_FLOAT32), platform.renderWidth * count, MIN_FLOAT);
+    } else {
+        memset(depthRowAt(y, platform.depthFormat), 0, depthBytes(platform.depthFormat) * platform.renderWidth * count);
+    }
+}
+
+static inline void ensureDepthCleared()
+{
+    if (platform.depthClearPending) {
+        clearDepthRows(0, platform.renderHeight);
+        platform.depthClearPending = false;
+    }
+}
+
+// Switches drawing to a render target of the given size
+static void setRenderSize(int width, int height)
+{
+    unlockScreen();
+    SDL_FreeSurface(platform.scaled);
+    platform.scaled = NULL;
+
+    if (width == SCREEN_WIDTH && height == SCREEN_HEIGHT) {
+        platform.screen = platform.frame;
+    } else {
+        if (platform.scaledPixels == NULL) {
+            platform.scaledPixels = (Pixel*)malloc(sizeof(Pixel) * SCREEN_WIDTH * SCREEN_HEIGHT);
+        }
+        const SDL_PixelFormat *format = platform.frame->format;
+        platform.scaled = SDL_CreateRGBSurfaceFrom(platform.scaledPixels, width, height,
+            BITS_PER_PIXEL, width * sizeof(Pixel), format->Rmask, format->Gmask, format->Bmask, format->Amask);
+        platform.screen = platform.scaled;
+    }
+    platform.renderWidth = width;
+    platform.renderHeight = height;
+
+    // The depth buffer's layout changed with the width, start over with a cleared one
+    platform.depthFrame = platform.depthClearInterval - 1;
+}
+
+// Nearest neighbour scaling: pixel x of `dst` takes source pixel
+// (x + 0.5) * step, in 16.16 fixed point
+static void scaleRow(Pixel *dst, int width, const Pixel *src, Uint32 step)
+{
+    Uint32 u = step >> 1;
+    for (int x = 0; x < width; x++) {
+        dst[x] = src[u >> 16];
+        u += step;
+    }
+}
+
+// Scales the render target up to the full size frame. Rows that sample the
+// same source row as the one before are copied from it.
+static void presentScaled()
+{
+    SDL_Surface *frame = platform.frame;
+    if (SDL_MUSTLOCK(frame)) {
+        SDL_LockSurface(frame);
+    }
+
+    Uint32 stepX = ((Uint32)platform.renderWidth << 16) / SCREEN_WIDTH;
+    Uint32 stepY = ((Uint32)platform.renderHeight << 16) / SCREEN_HEIGHT;
+    Uint32 v = stepY >> 1;
+    int previous = -1;
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+        Pixel *row = (Pixel*)((Uint8*)frame->pixels + y * frame->pitch);
+        int sourceY = v >> 16;
+        if (sourceY == previous) {
+            memcpy(row, (Uint8*)row - frame->pitch, SCREEN_WIDTH * sizeof(Pixel));
+        } else {
+            scaleRow(row, SCREEN_WIDTH, platform.scaledPixels + sourceY * platform.renderWidth, stepX);
+            previous = sourceY;
+        }
+        v += stepY;
+    }
+
+    if (SDL_MUSTLOCK(frame)) {
+        SDL_UnlockSurface(frame);
+    }
+}
+
+int BeginDrawing()
+{
+    // Render size changes wait for a frame boundary
+    int width = (int)(SCREEN_WIDTH * platform.renderScale + 0.5f * RENDER_SIZE_STEP) / RENDER_SIZE_STEP * RENDER_SIZE_STEP;
+    width = CLAMP(width, RENDER_SIZE_STEP, SCREEN_WIDTH);
+    if (width != platform.renderWidth) {
+        setRenderSize(width, width * SCREEN_HEIGHT / SCREEN_WIDTH);
+    }
+
+    // A frame that never touched depth leaves its clear to the next one
+    if (!platform.depthClearPending) {
+        platform.depthFrame = (platform.depthFrame + 1) % platform.depthClearInterval;
+        platform.depthClearPending = platform.depthFrame == 0;
+    }
+    platform.depthBase = platform.depthFrame * DEPTH_RANGE_STEP;
+
+    // Older frames' depths all lie below this frame's range
+    float staleMax = platform.depthFrame == 0 ? MIN_FLOAT : encodeDepth(platform.depthBase - DEPTH_RANGE_STEP + DEPTH_OVERLAY);
+    for (int i = 0; i < DEPTH_BLOCK_COUNT; i++) {
+        platform.depthBlockMin[i] = MIN_FLOAT;
+        platform.depthBlockMax[i] = staleMax;
+    }
+    for (int i = 0; i < RASTER_TILE_COUNT; i++) {
+        platform.depthTileMin[i] = MIN_FLOAT;
+    }
+
+    return 0;
+}
+
+void SetDepthClearInterval(int frames)
+{
+    platform.depthClearInterval = CLAMP(frames, 1, MAX_DEPTH_CLEAR_INTERVAL);
+    updateDepthEncoding();
+    // Start over with a cleared buffer on the next frame
+    platform.depthFrame = platform.depthClearInterval - 1;
+}
+
+void SetDirtyTracking(bool enabled)
+{
+    flushDrawCommands();
+    if (enabled == platform.dirtyTracking) {
+        return;
+    }
+    platform.dirtyTracking = enabled;
+
+    // Partial updates need a single buffered surface that keeps its
+    // contents from one frame to the next
+    setVideoMode(enabled ? SDL_SWSURFACE : SDL_HWSURFACE | SDL_DOUBLEBUF);
+}
+
+void SetRenderScale(float scale)
+{
+    platform.renderScale = CLAMP(scale, MIN_RENDER_SCALE, 1.0f);
+}
+
+int GetRenderWidth()
+{
+    return platform.renderWidth;
+}
+
+int GetRenderHeight()
+{
+    return platform.renderHeight;
+}
+
+void SetTargetFrameTime(float seconds)
+{
+    platform.targetFrameTime = MAX(seconds, 0.0f);
+    platform.frameTimeAverage = 0.0f;
+    platform.renderSettle = 0;
+}
+
+void UpdateRenderScale(float frameTime)
+{
+    if (platform.targetFrameTime <= 0.0f || frameTime <= 0.0f) {
+        return;
+    }
+
+    if (platform.frameTimeAverage <= 0.0f) {
+        platform.frameTimeAverage = frameTime;
+    } else {
+        platform.frameTimeAverage += (frameTime - platform.frameTimeAverage) * FRAME_TIME_SMOOTHING;
+    }
+    if (platform.renderSettle > 0) {
+        platform.renderSettle--;
+        return;
+    }
+
+    // Drawing time goes with the pixel count, the square of the scale.
+    // Step down as far as needed at once, but up one size at a time.
+    float load = platform.frameTimeAverage / platform.targetFrameTime;
+    float scale = platform.renderScale;
+    if (load > FRAME_TIME_SLOW) {
+        scale /= sqrtf(load);
+    } else if (load < FRAME_TIME_FAST) {
+        scale += (float)RENDER_SIZE_STEP / SCREEN_WIDTH;
+    } else {
+        return;
+    }
+
+    float previous = platform.renderScale;
+    SetRenderScale(scale);
+    if (platform.renderScale != previous) {
+        // Frame times from before the change no longer apply
+        platform.frameTimeAverage = 0.0f;
+        platform.renderSettle = RENDER_SIZE_SETTLE;
+    }
+}
+
+void ClearBackground(SDL_Color color)
+{
+    // Models recorded so far go under whatever is drawn directly from here on
+    flushDrawCommands();
+    lockScreen();
+    markDirtyAll();
+    Pixel pixel = SDL_MapRGB(platform.screen->format, color.r, color.g, color.b);
+    Pixel *pixels = (Pixel*)platform.screen->pixels;
+    int pitch = platform.screen->pitch / sizeof(Pixel);
+
+    // One pass over the frame: each color row and its depth row together
+    for (int y = 0; y < platform.renderHeight; y++) {
+        fillPixels(pixels + y * pitch, platform.renderWidth, pixel);
+        if (platform.depthClearPending) {
+            clearDepthRows(y, 1);
+        }
+    }
+    platform.depthClearPending = false;
+}
+
+bool SetBackgroundImage(SDL_Surface *image)
+{
+    SDL_FreeSurface(platform.background);
+    platform.background = NULL;
+    if (image == NULL) {
+        return true;
+    }
+
+    platform.background = SDL_ConvertSurface(image, platform.screen->format, SDL_SWSURFACE);
+    return platform.background != NULL;
+}
+
+void ClearBackgroundImage()
+{
+    if (platform.background == NULL) {
+        ClearBackground(COLOR_BLACK);
+        return;
+    }
+
+    flushDrawCommands();
+    lockScreen();
+    markDirtyAll();
+    SDL_Surface *background = platform.background;
+    int width = MIN(background->w, SCREEN_WIDTH);
+    int height = MIN(background->h, SCREEN_HEIGHT);
+    Uint8 *pixels = (Uint8*)platform.screen->pixels;
+
+    // Below the screen size the image shrinks with the frame, so it looks
+    // the same once scaled back up
+    bool scaled = platform.screen == platform.scaled;
+    Uint32 stepX = ((Uint32)SCREEN_WIDTH << 16) / platform.renderWidth;
+    Uint32 stepY = ((Uint32)SCREEN_HEIGHT << 16) / platform.renderHeight;
+    int scaledWidth = width * platform.renderWidth / SCREEN_WIDTH;
+    int scaledHeight = height * platform.renderHeight / SCREEN_HEIGHT;
+
+    for (int y = 0; y < platform.renderHeight; y++) {
+        if (scaled && y < scaledHeight) {
+            int sourceY = (int)((y * stepY + (stepY >> 1)) >> 16);
+            scaleRow((Pixel*)(pixels + y * platform.screen->pitch), scaledWidth,
+                     (const Pixel*)((Uint8*)background->pixels + sourceY * background->pitch), stepX);
+        } else if (!scaled && y < height) {
+            memcpy(pixels + y * platform.screen->pitch,
+                   (Uint8*)background->pixels + y * background->pitch,
+                   width * sizeof(Pixel));
+        }
+        if (platform.depthClearPending) {
+            clearDepthRows(y, 1);
+        }
+    }
+    platform.depthClearPending = false;
+}
+
+// Copies the dirty rectangles to the video surface and updates only them
+static void presentDirty()
+{
+    if (platform.dirtyCount == 0) {
+        return;
+    }
+    if (platform.frame != platform.video) {
+        for (int i = 0; i < platform.dirtyCount; i++) {
+            SDL_Rect target = platform.dirtyRects[i];
+            SDL_BlitSurface(platform.frame, &platform.dirtyRects[i], platform.video, &target);
+        }
+    }
+    SDL_UpdateRects(platform.video, platform.dirtyCount, platform.dirtyRects);
+}
+
+int EndDrawing()
+{
+    flushDrawCommands();
+
+    unlockScreen();
+    if (platform.screen == platform.scaled) {
+        // Scaled frames are presented whole
+        presentScaled();
+        markDirtyAll();
+    }
+    if (platform.dirtyTracking && !platform.dirtyAll) {
+        presentDirty();
+    } else {
+        if (platform.frame != platform.video) {
+            SDL_BlitSurface(platform.frame, NULL, platform.video, NULL);
+        }
+        SDL_Flip(platform.video);
+    }
+    platform.dirtyCount = 0;
+    platform.dirtyAll = false;
+
+    PollInputEvents();
+
+    return 0;
+}
+
+void DrawRectangle(SDL_Rect *rect, SDL_Color color)
+{
+    flushDrawCommands();
+    unlockScreen();
+    Pixel pixel = SDL_MapRGB(platform.screen->format, color.r, color.g, color.b);
+    if (rect == NULL) {
+        SDL_FillRect(platform.screen, NULL, pixel);
+        markDirtyAll();
+        return;
+    }
+
+    int x0 = toRenderX(rect->x), x1 = toRenderX(rect->x + rect->w);
+    int y0 = toRenderY(rect->y), y1 = toRenderY(rect->y + rect->h);
+    SDL_Rect target = { (Sint16)x0, (Sint16)y0, (Uint16)(x1 - x0), (Uint16)(y1 - y0) };
+    SDL_FillRect(platform.screen, &target, pixel);
+    markDirty(x0, y0, x1 - x0, y1 - y0);
+}
+
+// A copy of `image` shrunk to the render scale, in its own format, keyed
+// and blended as it is. Each pixel takes the image pixel under its center.
+static SDL_Surface *scaleImage(SDL_Surface *image)
+{
+    SDL_PixelFormat *format = image->format;
+    int width = toRenderX(image->w), height = toRenderY(image->h);
+    if (width <= 0 || height <= 0)
+    {
+        return NULL;
+    }
+    SDL_Surface *scaled = SDL_CreateRGBSurface(SDL_SWSURFACE, width, height,
+        format->BitsPerPixel, format->Rmask, format->Gmask, format->Bmask, format->Amask);
+    if (scaled == NULL)
+    {
+        return NULL;
+    }
+    if (format->palette != NULL) {
+        SDL_SetColors(scaled, format->palette->colors, 0, format->palette->ncolors);
+    }
+    if (image->flags & SDL_SRCCOLORKEY) {
+        SDL_SetColorKey(scaled, SDL_SRCCOLORKEY, format->colorkey);
+    }
+    if (image->flags & SDL_SRCALPHA) {
+        SDL_SetAlpha(scaled, SDL_SRCALPHA, format->alpha);
+    }
+
+    if (SDL_MUSTLOCK(image)) {
+        SDL_LockSurface(image);
+    }
+    int bytes = format->BytesPerPixel;
+    Uint32 stepX = ((Uint32)SCREEN_WIDTH << 16) / platform.renderWidth;
+    Uint32 stepY = ((Uint32)SCREEN_HEIGHT << 16) / platform.renderHeight;
+    for (int y = 0; y < height; y++) {
+        int sourceY = MIN((int)((y * stepY + (stepY >> 1)) >> 16), image->h - 1);
+        const Uint8 *src = (const Uint8*)image->pixels + sourceY * image->pitch;
+        Uint8 *dst = (Uint8*)scaled->pixels + y * scaled->pitch;
+        for (int x = 0; x < width; x++) {
+            int sourceX = MIN((int)((x * stepX + (stepX >> 1)) >> 16), image->w - 1);
+            memcpy(dst + x * bytes, src + sourceX * bytes, bytes);
+        }
+    }
+    if (SDL_MUSTLOCK(image)) {
+        SDL_UnlockSurface(image);
+    }
+
+    return scaled;
+}
+
+void DrawImage(SDL_Surface *image)
+{
+    flushDrawCommands();
+    unlockScreen();
+    if (platform.screen != platform.scaled) {
+        SDL_BlitSurface(image, NULL, platform.screen, NULL);
+        markDirty(0, 0, image->w, image->h);
+        return;
+    }
+
+    SDL_Surface *scaled = scaleImage(image);
+    if (scaled != NULL) {
+        SDL_BlitSurface(scaled, NULL, platform.screen, NULL);
+        SDL_FreeSurface(scaled);
+    }
+}
+
+// Copies `width` atlas pixels from `src` to `dst`, backwards through the
+// atlas when flipped, skipping the atlas's key when keyed
+static inline __attribute__((always_inline)) void copySpriteRow(Pixel *dst, const Pixel *src, int width, Pixel colorkey, bool keyed, bool flipped)
+{
+    if (!keyed && !flipped) {
+        memcpy(dst, src, width * sizeof(Pixel));
+        return;
+    }
+
+    int step = flipped ? -1 : 1;
+    for (int i = 0; i < width; i++, src += step) {
+        if (!keyed || *src != colorkey) {
+            dst[i] = *src;
+        }
+    }
+}
+
+// Draws the `width` x `height` atlas pixels at srcX, srcY shrunk to the
+// render scale, each render pixel taking the atlas pixel under its center
+static void blitSpriteScaled(const SpriteAtlas *atlas, int srcX, int srcY, int width, int height, int x, int y, int flip)
+{
+    int x0 = toRenderX(x), x1 = toRenderX(x + width);
+    int y0 = toRenderY(y), y1 = toRenderY(y + height);
+    int startX = MAX(x0, 0), endX = MIN(x1, platform.renderWidth);
+    int startY = MAX(y0, 0), endY = MIN(y1, platform.renderHeight);
+    if (startX >= endX || startY >= endY) {
+        return;
+    }
+
+    bool flipX = (flip & SPRITE_FLIP_X) != 0;
+    bool flipY = (flip & SPRITE_FLIP_Y) != 0;
+    Uint32 stepX = ((Uint32)SCREEN_WIDTH << 16) / platform.renderWidth;
+    Uint32 stepY = ((Uint32)SCREEN_HEIGHT << 16) / platform.renderHeight;
+
+    for (int py = startY; py < endY; py++) {
+        int sy = CLAMP((int)((py * stepY + (stepY >> 1)) >> 16) - y, 0, height - 1);
+        const Pixel *src = atlas->pixels + (srcY + (flipY ? height - 1 - sy : sy)) * atlas->width + srcX;
+        Pixel *row = (Pixel*)((Uint8*)platform.screen->pixels + py * platform.screen->pitch);
+        for (int px = startX; px < endX; px++) {
+            int sx = CLAMP((int)((px * stepX + (stepX >> 1)) >> 16) - x, 0, width - 1);
+            Pixel pixel = src[flipX ? width - 1 - sx : sx];
+            if (!atlas->keyed || pixel != atlas->colorkey) {
+                row[px] = pixel;
+            }
+        }
+    }
+}
+
+static void blitSprite(const SpriteAtlas *atlas, SDL_Rect source, int x, int y, int flip)
+{
+    // Source rect within the atlas
+    int srcX = MAX((int)source.x, 0), srcY = MAX((int)source.y, 0);
+    int width = MIN((int)source.x + (int)source.w, atlas->width) - srcX;
+    int height = MIN((int)source.y + (int)source.h, atlas->height) - srcY;
+    x += srcX - source.x;
+    y += srcY - source.y;
+    if (platform.screen == platform.scaled) {
+        blitSpriteScaled(atlas, srcX, srcY, width, height, x, y, flip);
+        return;
+    }
+
+    // Clipping one side of the destination takes from the other side of
+    // the source when flipped
+    int clipLeft = MAX(-x, 0), clipRight = MAX(x + width - platform.renderWidth, 0);
+    int clipTop = MAX(-y, 0), clipBottom = MAX(y + height - platform.renderHeight, 0);
+    width -= clipLeft + clipRight;
+    height -= clipTop + clipBottom;
+    if (width <= 0 || height <= 0) {
+        return;
+    }
+
+    markDirty(x + clipLeft, y + clipTop, width, height);
+
+    bool flipX = (flip & SPRITE_FLIP_X) != 0;
+    bool flipY = (flip & SPRITE_FLIP_Y) != 0;
+    srcX += flipX ? clipRight + width - 1 : clipLeft;
+    srcY += flipY ? clipBottom + height - 1 : clipTop;
+
+    const Pixel *src = atlas->pixels + srcY * atlas->width + srcX;
+    int srcPitch = flipY ? -atlas->width : atlas->width;
+    Pixel *dst = (Pixel*)((Uint8*)platform.screen->pixels + (y + clipTop) * platform.screen->pitch) + x + clipLeft;
+    int dstPitch = platform.screen->pitch / sizeof(Pixel);
+
+    #define COPY_ROWS(keyed, flipped) \
+        for (int row = 0; row < height; row++, src += srcPitch, dst += dstPitch) { \
+            copySpriteRow(dst, src, width, atlas->colorkey, keyed, flipped); \
+        }
+    if (atlas->keyed) {
+        if (flipX) COPY_ROWS(true, true) else COPY_ROWS(true, false)
+    } else {
+        if (flipX) COPY_ROWS(false, true) else COPY_ROWS(false, false)
+    }
+    #undef COPY_ROWS
+}
+
+void DrawSprite(const SpriteAtlas *atlas, SDL_Rect source, int x, int y, int flip)
+{
+    flushDrawCommands();
+    lockScreen();
+    blitSprite(atlas, source, x, y, flip);
+}
+
+// By atlas, then in submission order, which is their order in memory
+static int compareSprites(const void *a, const void *b)
+{
+    const Sprite *sa = *(const Sprite* const*)a;
+    const Sprite *sb = *(const Sprite* const*)b;
+
+    if (sa->atlas != sb->atlas) {
+        return sa->atlas < sb->atlas ? -1 : 1;
+    }
+    return sa < sb ? -1 : (sa > sb ? 1 : 0);
+}
+
+void DrawSprites(const Sprite *sprites, int count)
+{
+    flushDrawCommands();
+    kv_empty(renderState.spriteOrder);
+    for (int i = 0; i < count; i++) {
+        kv_push(const Sprite*, renderState.spriteOrder, &sprites[i]);
+    }
+    qsort(renderState.spriteOrder.a, count, sizeof(const Sprite*), compareSprites);
+
+    lockScreen();
+    for (int i = 0; i < count; i++) {
+        const Sprite *sprite = kv_A(renderState.spriteOrder, i);
+        blitSprite(sprite->atlas, sprite->source, sprite->x, sprite->y, sprite->flip);
+    }
+}
+
+// drawGlyph shrunk to the render scale, each render pixel inked when the
+// atlas pixel under its center is
+static void drawGlyphScaled(const Font *font, const Glyph *glyph, int x, int y, Pixel pixel)
+{
+    int startX = MAX(toRenderX(x), 0), endX = MIN(toRenderX(x + glyph->width), platform.renderWidth);
+    int startY = MAX(toRenderY(y), 0), endY = MIN(toRenderY(y + glyph->height), platform.renderHeight);
+    if (startX >= endX || startY >= endY) {
+        return;
+    }
+
+    Uint32 stepX = ((Uint32)SCREEN_WIDTH << 16) / platform.renderWidth;
+    Uint32 stepY = ((Uint32)SCREEN_HEIGHT << 16) / platform.renderHeight;
+    for (int py = startY; py < endY; py++) {
+        int gy = CLAMP((int)((py * stepY + (stepY >> 1)) >> 16) - y, 0, glyph->height - 1);
+        const Uint8 *ink = font->atlas + (glyph->y + gy) * FONT_ATLAS_WIDTH + glyph->x;
+        Pixel *row = (Pixel*)((Uint8*)platform.screen->pixels + py * platform.screen->pitch);
+        for (int px = startX; px < endX; px++) {
+            int gx = CLAMP((int)((px * stepX + (stepX >> 1)) >> 16) - x, 0, glyph->width - 1);
+            if (ink[gx]) {
+                row[px] = pixel;
+            }
+        }
+    }
+}
+
+// Copies the glyph's inked pixels in `pixel`, clipped to the render target
+static void drawGlyph(const Font *font, const Glyph *glyph, int x, int y, Pixel pixel)
+{
+    if (platform.screen == platform.scaled) {
+        drawGlyphScaled(font, glyph, x, y, pixel);
+        return;
+    }
+    int startX = MAX(x, 0), endX = MIN(x + glyph->width, platform.renderWidth);
+    int startY = MAX(y, 0), endY = MIN(y + glyph->height, platform.renderHeight);
+    if (startX >= endX || startY >= endY) {
+        return;
+    }
+    markDirty(startX, startY, endX - startX, endY - startY);
+
+    for (int py = startY; py < endY; py++) {
+        const Uint8 *ink = font->atlas + (glyph->y + py - y) * FONT_ATLAS_WIDTH + glyph->x - x;
+        Pixel *row = (Pixel*)((Uint8*)platform.screen->pixels + py * platform.screen->pitch);
+        for (int px = startX; px < endX; px++) {
+            if (ink[px]) {
+                row[px] = pixel;
+            }
+        }
+    }
+}
+
+void DrawTextEx(const Font *font, const char *text, Vector2 position, SDL_Color color)
+{
+    if (font->atlas == NULL) {
+        return;
+    }
+
+    flushDrawCommands();
+    Pixel pixel = SDL_MapRGB(platform.screen->format, color.r, color.g, color.b);
+    int penX = (int)position.x, lineY = (int)position.y;
+    int previous = -1;
+
+    lockScreen();
+    for (const Uint8 *c = (const Uint8*)text; *c != '\0'; c++) {
+        if (*c == '\n') {
+            penX = (int)position.x;
+            lineY += font->lineSkip;
+            previous = -1;
+            continue;
+        }
+
+        int index = *c - FONT_FIRST_GLYPH;
+        if (*c >= 0x80) {
+            // One missing glyph for the whole UTF-8 sequence
+            while ((c[1] & 0xC0) == 0x80) {
+                c++;
+            }
+            index = -1;
+        }
+        if (index < 0 || index >= FONT_GLYPH_COUNT) {
+            index = FONT_MISSING_GLYPH - FONT_FIRST_GLYPH;
+        }
+
+        const Glyph *glyph = &font->glyphs[index];
+        if (previous >= 0) {
+            penX += font->kerning[previous][index];
+        } else if (glyph->offsetX < 0) {
+            // Lines start at the ink, as SDL_ttf lays them out
+            penX -= glyph->offsetX;
+        }
+        drawGlyph(font, glyph, penX + glyph->offsetX, lineY + glyph->offsetY, pixel);
+        penX += glyph->advance;
+        previous = index;
+    }
+}
+
+void PutPixelDepth(int x, int y, float w, Pixel pixel) {
+    flushDrawCommands();
+    if (
+           x < 0 || x + 1 > platform.renderWidth
+        || y < 0 || y + 1 > platform.renderHeight
+    ) {
+        return;
+    }
+    ensureDepthCleared();
+    w = encodeDepth(w + platform.depthBase);
+
+    if (testWriteDepth(depthRowAt(y, platform.depthFormat), x, w, platform.depthFormat)) {
+        lockScreen();
+        Pixel *row = (Pixel*)((Uint8*)platform.screen->pixels + y * platform.screen->pitch);
+        row[x] = pixel;
+        markDirty(x, y, 1, 1);
+
+        float *blockMax = &platform.depthBlockMax[(y / RASTER_BLOCK) * DEPTH_BLOCKS_X + x / RASTER_BLOCK];
+        *blockMax = MAX(*blockMax, w);
+    }
+}
+
+void DrawPixelDepth(int x, int y, float w, SDL_Color color) {
+    PutPixelDepth(x, y, w, SDL_MapRGB(platform.screen->format, color.r, color.g, color.b));
+}
+
+void DrawPixel(int x, int y, SDL_Color color) {
+    DrawPixelDepth(x, y, DEPTH_OVERLAY, color);
+}
+
+void PutPixel(int x, int y, Pixel pixel) {
+    PutPixelDepth(x, y, DEPTH_OVERLAY, pixel);
+}
+
+// Clips the segment to the pixel centers of the render target, in place.
+// Returns false when none of it is on screen.
+static bool clipLine(Vector4 *p0, Vector4 *p1)
+{
+    float dx = p1->x - p0->x, dy = p1->y - p0->y;
+    float p[4] = { -dx, dx, -dy, dy };
+    float q[4] = {
+        p0->x - 0.5f, (float)platform.renderWidth - 0.5f - p0->x,
+        p0->y - 0.5f, (float)platform.renderHeight - 0.5f - p0->y,
+    };
+
+    // Liang-Barsky: the parameter range left inside all four edges
+    float t0 = 0.0f, t1 = 1.0f;
+    for (int i = 0; i < 4; i++) {
+        if (p[i] == 0.0f) {
+            if (q[i] < 0.0f) {
+                return false;
+            }
+        } else if (p[i] < 0.0f) {
+            t0 = MAX(t0, q[i] / p[i]);
+        } else {
+            t1 = MIN(t1, q[i] / p[i]);
+        }
+    }
+    if (t0 > t1) {
+        return false;
+    }
+
+    Vector4 start = *p0;
+    Vector4 delta = VectorSub(*p1, start);
+    *p0 = VectorAdd(start, VectorMul(delta, t0));
+    *p1 = VectorAdd(start, VectorMul(delta, t1));
+    return true;
+}
+
+// Plots the clipped line p0-p1, one pixel per column or row along its major
+// axis, where it passes the pixel centers. The minor coordinate steps in
+// 16.16 fixed point. z is in the depth buffer's units, only used with `depthTest`.
+static inline __attribute__((always_inline)) void plotLine(Vector4 p0, Vector4 p1, Pixel pixel, bool depthTest, int format)
+{
+    bool steep = fabsf(p1.y - p0.y) > fabsf(p1.x - p0.x);
+    if (steep) {
+        SWAP(p0.x, p0.y, float);
+        SWAP(p1.x, p1.y, float);
+    }
+    if (p1.x < p0.x) {
+        SWAP(p0, p1, Vector4);
+    }
+
+    int first = (int)ceilf(p0.x - 0.5f);
+    int last = (int)floorf(p1.x - 0.5f);
+    if (first > last) {
+        return;
+    }
+
+    float length = p1.x - p0.x;
+    float slope = length > 0.0f ? (p1.y - p0.y) / length : 0.0f;
+    float dz = length > 0.0f ? (p1.z - p0.z) / length : 0.0f;
+    float offset = (float)first + 0.5f - p0.x;
+    int minor = (int)((p0.y + slope * offset) * 65536.0f);
+    int minorStep = (int)(slope * 65536.0f);
+    float z = p0.z + dz * offset;
+
+    Pixel *pixels = (Pixel*)platform.screen->pixels;
+    int pitch = platform.screen->pitch / sizeof(Pixel);
+
+    for (int major = first; major <= last; major++, minor += minorStep, z += dz) {
+        int x = steep ? minor >> 16 : major;
+        int y = steep ? major : minor >> 16;
+        if (depthTest) {
+            if (!testWriteDepth(depthRowAt(y, format), x, z, format)) {
+                continue;
+            }
+            float *blockMax = &platform.depthBlockMax[(y / RASTER_BLOCK) * DEPTH_BLOCKS_X + x / RASTER_BLOCK];
+            *blockMax = MAX(*blockMax, z);
+        }
+        pixels[y * pitch + x] = pixel;
+    }
+}
+
+static void drawLineBatch(const Vector4 *points, int count, Pixel pixel, bool depthTest)
+{
+    if (depthTest) {
+        ensureDepthCleared();
+    }
+    lockScreen();
+    int format = platform.depthFormat;
+
+    for (int i = 0; i < count; i++) {
+        Vector4 p0 = points[2 * i], p1 = points[2 * i + 1];
+        if (!clipLine(&p0, &p1)) {
+            continue;
+        }
+        if (platform.dirtyTracking) {
+            int minX = (int)MIN(p0.x, p1.x), minY = (int)MIN(p0.y, p1.y);
+            markDirty(minX, minY, (int)MAX(p0.x, p1.x) - minX + 1, (int)MAX(p0.y, p1.y) - minY + 1);
+        }
+        if (!depthTest) {
+            plotLine(p0, p1, pixel, false, format);
+            continue;
+        }
+
+        // Toward the viewer by the depth change of a pixel step, so that
+        // lines stay on top of the faces they were taken from
+        float steps = MAX(fabsf(p1.x - p0.x), fabsf(p1.y - p0.y));
+        float bias = steps > 0.0f ? fabsf(p1.z - p0.z) / steps : 0.0f;
+        bias += DEPTH_SLACK * (fabsf(p0.z) + fabsf(p1.z) + 2.0f * platform.depthBase);
+        p0.z = encodeDepth(p0.z + platform.depthBase + bias);
+        p1.z = encodeDepth(p1.z + platform.depthBase + bias);
+
+        switch (format) {
+        case DEPTH_FORMAT_FIXED16: plotLine(p0, p1, pixel, true, DEPTH_FORMAT_FIXED16); break;
+        case DEPTH_FORMAT_INT24: plotLine(p0, p1, pixel, true, DEPTH_FORMAT_INT24); break;
+        default: plotLine(p0, p1, pixel, true, DEPTH_FORMAT_FLOAT32); break;
+        }
+    }
+}
+
+void DrawLines(const Vector4 *points, int count, SDL_Color color, bool depthTest)
+{
+    flushDrawCommands();
+    drawLineBatch(points, count, SDL_MapRGB(platform.screen->format, color.r, color.g, color.b), depthTest);
+}
+
+void DrawLine(int startPosX, int startPosY, int endPosX, int endPosY, SDL_Color color)
+{
+    // Through the centers of the end pixels, so both of them get drawn,
+    // placed on the screen like the rest of 2D
+    float scaleX = (float)platform.renderWidth / SCREEN_WIDTH;
+    float scaleY = (float)platform.renderHeight / SCREEN_HEIGHT;
+    Vector4 points[2] = {
+        { ((float)startPosX + 0.5f) * scaleX, ((float)startPosY + 0.5f) * scaleY, 0.0f, 1.0f },
+        { ((float)endPosX + 0.5f) * scaleX, ((float)endPosY + 0.5f) * scaleY, 0.0f, 1.0f },
+    };
+    DrawLines(points, 1, color, false);
+}
+
+void DrawTriangle(Triangle3d triangle, SDL_Color color) {
+    Vector4 points[6] = {
+        triangle.points[0], triangle.points[1],
+        triangle.points[1], triangle.points[2],
+        triangle.points[2], triangle.points[0],
+    };
+    DrawLines(points, 3, color, false);
+}
+
+// Queues the outline of a convex polygon of screen points for the wireframe
+static void queueWireEdges(const Vector4 *points, int count)
+{
+    for (int i = 0; i < count; i++) {
+        kv_push(Vector4, renderState.wireLines, points[i]);
+        kv_push(Vector4, renderState.wireLines, points[(i + 1) % count]);
+    }
+}
+
+static inline int toSubpixel(float v) {
+    return (int)(v * SUBPIXEL_ONE + (v >= 0.0f ? 0.5f : -0.5f));
+}
+
+// Edge function of v0 -> v1, positive on the inside of a counter-clockwise
+// (in fixed point) triangle. Edges that are neither top nor left get a bias of
+// -1 so that pixels exactly on a shared edge are only filled once.
+static inline RasterEdge makeRasterEdge(int x0, int y0, int x1, int y1) {
+    int a = y0 - y1;
+    int b = x1 - x0;
+    bool topLeft = a > 0 || (a == 0 && b > 0);
+
+    RasterEdge edge;
+    edge.stepX = a * SUBPIXEL_ONE;
+    edge.stepY = b * SUBPIXEL_ONE;
+    edge.origin = a * (SUBPIXEL_HALF - x0) + b * (SUBPIXEL_HALF - y0) - (topLeft ? 0 : 1);
+
+    // The extremes of a linear function over a block are at its corners
+    int cornerX = edge.stepX * (RASTER_BLOCK - 1);
+    int cornerY = edge.stepY * (RASTER_BLOCK - 1);
+    edge.blockMin = MIN(cornerX, 0) + MIN(cornerY, 0);
+    edge.blockMax = MAX(cornerX, 0) + MAX(cornerY, 0);
+
+    return edge;
+}
+
+static inline int rasterEdgeAt(const RasterEdge *edge, int x, int y) {
+    return edge->origin + edge->stepX * x + edge->stepY * y;
+}
+
+// A value interpolated linearly in screen space, in pixel units
+typedef struct RasterPlane {
+    float origin;       // at the center of pixel (0, 0)
+    float dx, dy;
+} RasterPlane;
+
+static RasterPlane makeRasterPlane(int x0, int y0, int x1, int y1, int x2, int y2, float a0, float a1, float a2)
+{
+    float fx1 = (float)(x1 - x0) / SUBPIXEL_ONE, fy1 = (float)(y1 - y0) / SUBPIXEL_ONE;
+    float fx2 = (float)(x2 - x0) / SUBPIXEL_ONE, fy2 = (float)(y2 - y0) / SUBPIXEL_ONE;
+    float invDet = 1.0f / (fx1 * fy2 - fx2 * fy1);
+    float da1 = a1 - a0, da2 = a2 - a0;
+
+    RasterPlane plane;
+    plane.dx = (da1 * fy2 - da2 * fy1) * invDet;
+    plane.dy = (da2 * fx1 - da1 * fx2) * invDet;
+    plane.origin = a0
+        + plane.dx * (0.5f - (float)x0 / SUBPIXEL_ONE)
+        + plane.dy * (0.5f - (float)y0 / SUBPIXEL_ONE);
+    return plane;
+}
+
+static inline float rasterPlaneAt(const RasterPlane *plane, int x, int y)
+{
+    return plane->origin + plane->dx * (float)x + plane->dy * (float)y;
+}
+
+// Fills the triangle's pattern with `color`, dithered if enabled. Each channel
+// is raised by up to one step of its own precision before it is truncated.
+static void setRasterColor(RasterTriangle *tri, SDL_Color color) {
+    const SDL_PixelFormat *format = platform.screen->format;
+
+    if (!renderState.dithering || DITHER_SIZE == 1) {
+        Pixel pixel = SDL_MapRGB(format, color.r, color.g, color.b);
+        for (int y = 0; y < DITHER_SIZE; y++) {
+            for (int x = 0; x < DITHER_SIZE; x++) {
+                tri->pixels[y][x] = pixel;
+            }
+        }
+        return;
+    }
+
+    for (int y = 0; y < DITHER_SIZE; y++) {
+        for (int x = 0; x < DITHER_SIZE; x++) {
+            int threshold = ditherPattern[y][x];
+            int r = MIN(color.r + ((threshold << format->Rloss) >> 4), 255);
+            int g = MIN(color.g + ((threshold << format->Gloss) >> 4), 255);
+            int b = MIN(color.b + ((threshold << format->Bloss) >> 4), 255);
+            tri->pixels[y][x] = SDL_MapRGB(format, r, g, b);
+        }
+    }
+}
+
+// Prepares p0, p1, p2 (screen x/y and depth in z) for rasterizeTriangle.
+// With `shades`, the intensity levels (0 to 255) of the three vertices, the
+// triangle is smooth shaded through renderState.shadeRamp, otherwise it is
+// filled with `color`. Returns false when there is nothing to draw.
+static bool setupRasterTriangle(RasterTriangle *tri, Vector4 p0, Vector4 p1, Vector4 p2, const float *shades, SDL_Color color) {
+    int x0 = toSubpixel(p0.x), y0 = toSubpixel(p0.y);
+    int x1 = toSubpixel(p1.x), y1 = toSubpixel(p1.y);
+    int x2 = toSubpixel(p2.x), y2 = toSubpixel(p2.y);
+
+    int area = (x1 - x0) * (y2 - y0) - (y1 - y0) * (x2 - x0);
+    if (area == 0) {
+        return false;
+    }
+    float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f;
+    if (shades != NULL) {
+        s0 = shades[0];
+        s1 = shades[1];
+        s2 = shades[2];
+    }
+    if (area < 0) {
+        SWAP(x1, x2, int);
+        SWAP(y1, y2, int);
+        SWAP(p1, p2, Vector4);
+        SWAP(s1, s2, float);
+    }
+
+    tri->minX = MAX(MIN(x0, MIN(x1, x2)) >> SUBPIXEL_BITS, 0);
+    tri->minY = MAX(MIN(y0, MIN(y1, y2)) >> SUBPIXEL_BITS, 0);
+    tri->maxX = MIN(MAX(x0, MAX(x1, x2)) >> SUBPIXEL_BITS, platform.renderWidth - 1);
+    tri->maxY = MIN(MAX(y0, MAX(y1, y2)) >> SUBPIXEL_BITS, platform.renderHeight - 1);
+    if (tri->minX > tri->maxX || tri->minY > tri->maxY) {
+        return false;
+    }
+
+    tri->edges[0] = makeRasterEdge(x1, y1, x2, y2);
+    tri->edges[1] = makeRasterEdge(x2, y2, x0, y0);
+    tri->edges[2] = makeRasterEdge(x0, y0, x1, y1);
+
+    // Depth plane, in pixel units
+    float fx1 = (float)(x1 - x0) / SUBPIXEL_ONE, fy1 = (float)(y1 - y0) / SUBPIXEL_ONE;
+    float fx2 = (float)(x2 - x0) / SUBPIXEL_ONE, fy2 = (float)(y2 - y0) / SUBPIXEL_ONE;
+    float invDet = 1.0f / (fx1 * fy2 - fx2 * fy1);
+    float dz1 = p1.z - p0.z, dz2 = p2.z - p0.z;
+    tri->dzdx = (dz1 * fy2 - dz2 * fy1) * invDet;
+    tri->dzdy = (dz2 * fx1 - dz1 * fx2) * invDet;
+    tri->zOrigin = platform.depthBase + p0.z
+        + tri->dzdx * (0.5f - (float)x0 / SUBPIXEL_ONE)
+        + tri->dzdy * (0.5f - (float)y0 / SUBPIXEL_ONE);
+
+    tri->zMin = platform.depthBase + MIN(p0.z, MIN(p1.z, p2.z));
+    tri->zMax = platform.depthBase + MAX(p0.z, MAX(p1.z, p2.z));
+
+    // From here on in the buffer's units
+    if (platform.depthFormat != DEPTH_FORMAT_FLOAT32) {
+        tri->zOrigin = encodeDepth(tri->zOrigin);
+        tri->dzdx *= platform.depthScale;
+        tri->dzdy *= platform.depthScale;
+        tri->zMin = encodeDepth(tri->zMin);
+        tri->zMax = encodeDepth(tri->zMax);
+    }
+    tri->zSlack = DEPTH_SLACK * (fabsf(tri->zOrigin)
+        + fabsf(tri->dzdx) * SCREEN_WIDTH
+        + fabsf(tri->dzdy) * SCREEN_HEIGHT);
+
+    tri->ramp = NULL;
+
+    if (shades == NULL) {
+        setRasterColor(tri, color);
+    } else {
+        RasterPlane shade = makeRasterPlane(x0, y0, x1, y1, x2, y2, s0, s1, s2);
+        if (fabsf(shade.dx) <= MAX_SHADE_GRADIENT && fabsf(shade.dy) <= MAX_SHADE_GRADIENT) {
+            tri->ramp = renderState.shadeRamp;
+            tri->shadeOrigin = shade.origin * 65536.0f;
+            tri->dsdx = shade.dx * 65536.0f;
+            tri->dsdy = shade.dy * 65536.0f;
+        } else {
+            // A sliver, too thin for its gradient to fit in fixed point
+            Uint8 level = (Uint8)MIN((s0 + s1 + s2) * (1.0f / 3.0f), SHADE_LEVELS - 1);
+            setRasterColor(tri, (SDL_Color){ level, level, level, 0 });
+        }
+    }
+
+    return true;
+}
+
+// Color of a smooth shaded pixel at gray level `shade` (16.16), dithered by
+// its offset in `dither`, the pixel's row of renderState.shadeDither
+static inline __attribute__((always_inline)) Pixel shadePixel(const Pixel *ramp, Uint32 shade, const Uint32 *dither, int x) {
+#if DITHER_SIZE > 1
+    shade += dither[x & DITHER_MASK];
+#else
+    (void)dither;
+    (void)x;
+#endif
+    return ramp[shade >> 16];
+}
+
+// Half-space rasterizer. Pixels are sampled at their centers and only those
+// inside [clipMinX, clipMaxX) x [clipMinY, clipMaxY) are touched. Depth comes
+// from the triangle's plane equation, restarted at every block and stepped
+// inside it, so a pixel's depth doesn't depend on which blocks were visited
+// and any split of the screen into block-aligned clip rects gives the same image.
+//
+// Before a block is walked its depth range is checked against the block's
+// hierarchical Z bounds: blocks entirely behind what is stored are skipped,
+// blocks entirely in front of it are written without reading the depth buffer.
+//
+// Always inlined into rasterizeTriangle, once for every combination of flat or
+// smooth shading and depth format, so that none pays for the others in its
+// inner loops.
+static inline __attribute__((always_inline)) void rasterizeTriangleShaded(
+    const RasterTriangle *tri, int clipMinX, int clipMinY, int clipMaxX, int clipMaxY, bool smooth, int format) {
+    int minX = MAX(tri->minX, clipMinX);
+    int minY = MAX(tri->minY, clipMinY);
+    int maxX = MIN(tri->maxX, clipMaxX - 1);
+    int maxY = MIN(tri->maxY, clipMaxY - 1);
+    if (minX > maxX || minY > maxY) {
+        return;
+    }
+
+    const RasterEdge *edges = tri->edges;
+    float dzdx = tri->dzdx, dzdy = tri->dzdy;
+    const Pixel *ramp = tri->ramp;
+    Uint32 dsdx = smooth ? (Uint32)(int)tri->dsdx : 0;
+    Uint32 dsdy = smooth ? (Uint32)(int)tri->dsdy : 0;
+
+    Pixel *pixels = (Pixel*)platform.screen->pixels;
+    int pitch = platform.screen->pitch / sizeof(Pixel);
+    float *blockMin = platform.depthBlockMin;
+    float *blockMax = platform.depthBlockMax;
+
+    const int blockSpan = RASTER_BLOCK - 1;
+
+    // Depth range of the plane over a block, relative to its first pixel
+    float zCornerX = dzdx * blockSpan, zCornerY = dzdy * blockSpan;
+    float zCornerMin = MIN(zCornerX, 0.0f) + MIN(zCornerY, 0.0f) - tri->zSlack;
+    float zCornerMax = MAX(zCornerX, 0.0f) + MAX(zCornerY, 0.0f) + tri->zSlack;
+    float zFarthest = tri->zMin - tri->zSlack;
+    float zNearest = tri->zMax + tri->zSlack;
+
+    for (int by = minY & ~blockSpan; by <= maxY; by += RASTER_BLOCK) {
+        for (int bx = minX & ~blockSpan; bx <= maxX; bx += RASTER_BLOCK) {
+            int e[3];
+            bool reject = false;
+            bool accept = true;
+
+            for (int k = 0; k < 3; k++) {
+                e[k] = rasterEdgeAt(&edges[k], bx, by);
+                if (e[k] + edges[k].blockMax < 0) {
+                    reject = true;
+                    break;
+                }
+                if (e[k] + edges[k].blockMin < 0) {
+                    accept = false;
+                }
+            }
+            if (reject) {
+                continue;
+            }
+
+            int block = (by / RASTER_BLOCK) * DEPTH_BLOCKS_X + bx / RASTER_BLOCK;
+            float zBlock = tri->zOrigin + dzdx * (float)bx + dzdy * (float)by;
+            float zNear = MIN(zBlock + zCornerMax, zNearest);
+            if (zNear <= blockMin[block]) {
+                continue;
+            }
+            float zFar = MAX(zBlock + zCornerMin, zFarthest);
+            bool visible = zFar > blockMax[block];
+            blockMax[block] = MAX(blockMax[block], zNear);
+
+            int startX = MAX(bx, minX), endX = MIN(bx + blockSpan, maxX);
+            int startY = MAX(by, minY), endY = MIN(by + blockSpan, maxY);
+
+            float zRow = tri->zOrigin + dzdx * (float)startX + dzdy * (float)startY;
+
+            // Unsigned so stepping through pixels outside the triangle may wrap,
+            // the values inside are back in range
+            Uint32 sRow = 0;
+            if (smooth) {
+                sRow = (Uint32)(Sint64)(tri->shadeOrigin + tri->dsdx * (float)startX + tri->dsdy * (float)startY);
+            }
+
+            if (accept && !smooth) {
+                // Covered rows of flat triangles go through the span primitives
+                for (int y = startY; y <= endY; y++) {
+                    Pixel *row = pixels + y * pitch;
+                    void *depthRow = depthRowAt(y, format);
+                    const Pixel *pattern = tri->pixels[y & DITHER_MASK];
+                    if (visible) {
+                        fillSpan(row, depthRow, startX, endX + 1, zRow, dzdx, pattern, format);
+                    } else {
+                        fillSpanDepthTest(row, depthRow, startX, endX + 1, zRow, dzdx, pattern, format);
+                    }
+                    zRow += dzdy;
+                }
+            } else if (accept) {
+                if (visible) {
+                    for (int y = startY; y <= endY; y++) {
+                        Pixel *row = pixels + y * pitch;
+                        void *depthRow = depthRowAt(y, format);
+                        const Uint32 *dither = renderState.shadeDither[y & DITHER_MASK];
+                        float z = zRow;
+                        Uint32 shade = sRow;
+                        for (int x = startX; x <= endX; x++) {
+                            row[x] = shadePixel(ramp, shade, dither, x);
+                            writeDepth(depthRow, x, z, format);
+                            z += dzdx;
+                            shade += dsdx;
+                        }
+                        zRow += dzdy;
+                        sRow += dsdy;
+                    }
+                } else {
+                    for (int y = startY; y <= endY; y++) {
+                        Pixel *row = pixels + y * pitch;
+                        void *depthRow = depthRowAt(y, format);
+                        const Uint32 *dither = renderState.shadeDither[y & DITHER_MASK];
+                        float z = zRow;
+                        Uint32 shade = sRow;
+                        for (int x = startX; x <= endX; x++) {
+                            if (testWriteDepth(depthRow, x, z, format)) {
+                                row[x] = shadePixel(ramp, shade, dither, x);
+                            }
+                            z += dzdx;
+                            shade += dsdx;
+                        }
+                        zRow += dzdy;
+                        sRow += dsdy;
+                    }
+                }
+            }
+            if (accept) {
+                // Every pixel of a covered block now holds at least zFar
+                if (startX == bx && startY == by && endX == bx + blockSpan && endY == by + blockSpan) {
+                    blockMin[block] = MAX(blockMin[block], zFar);
+                }
+                continue;
+            }
+
+            int dx = startX - bx, dy = startY - by;
+            int e0Row = e[0] + edges[0].stepX * dx + edges[0].stepY * dy;
+            int e1Row = e[1] + edges[1].stepX * dx + edges[1].stepY * dy;
+            int e2Row = e[2] + edges[2].stepX * dx + edges[2].stepY * dy;
+
+            for (int y = startY; y <= endY; y++) {
+                Pixel *row = pixels + y * pitch;
+                void *depthRow = depthRowAt(y, format);
+                const Pixel *pattern = tri->pixels[y & DITHER_MASK];
+                const Uint32 *dither = renderState.shadeDither[y & DITHER_MASK];
+                int e0 = e0Row, e1 = e1Row, e2 = e2Row;
+                float z = zRow;
+                Uint32 shade = sRow;
+                bool entered = false;
+                for (int x = startX; x <= endX; x++) {
+                    if ((e0 | e1 | e2) >= 0) {
+                        if (visible) {
+                            row[x] = smooth ? shadePixel(ramp, shade, dither, x) : pattern[x & DITHER_MASK];
+                            writeDepth(depthRow, x, z, format);
+                        } else if (testWriteDepth(depthRow, x, z, format)) {
+                            row[x] = smooth ? shadePixel(ramp, shade, dither, x) : pattern[x & DITHER_MASK];
+                        }
+                        entered = true;
+                    } else if (entered) {
+                        // Triangles are convex, nothing more to fill on this row
+                        break;
+                    }
+                    e0 += edges[0].stepX;
+                    e1 += edges[1].stepX;
+                    e2 += edges[2].stepX;
+                    z += dzdx;
+                    shade += dsdx;
+                }
+                e0Row += edges[0].stepY;
+                e1Row += edges[1].stepY;
+                e2Row += edges[2].stepY;
+                zRow += dzdy;
+                sRow += dsdy;
+            }
+        }
+    }
+}
+
+static void rasterizeTriangle(const RasterTriangle *tri, int clipMinX, int clipMinY, int clipMaxX, int clipMaxY) {
+    bool smooth = tri->ramp != NULL;
+
+    #define RASTERIZE(smooth, format) \
+        rasterizeTriangleShaded(tri, clipMinX, clipMinY, clipMaxX, clipMaxY, smooth, format)
+    switch (platform.depthFormat) {
+    case DEPTH_FORMAT_FIXED16:
+        if (smooth) RASTERIZE(true, DEPTH_FORMAT_FIXED16); else RASTERIZE(false, DEPTH_FORMAT_FIXED16);
+        break;
+    case DEPTH_FORMAT_INT24:
+        if (smooth) RASTERIZE(true, DEPTH_FORMAT_INT24); else RASTERIZE(false, DEPTH_FORMAT_INT24);
+        break;
+    default:
+        if (smooth) RASTERIZE(true, DEPTH_FORMAT_FLOAT32); else RASTERIZE(false, DEPTH_FORMAT_FLOAT32);
+        break;
+    }
+    #undef RASTERIZE
+}
+
+// A vertex of a triangle given in screen coordinates, with up to three
+// values that are linear in screen space
+typedef struct ScreenVertex {
+    float x, y;
+    float values[3];
+} ScreenVertex;
+
+// One pass of Sutherland-Hodgman against the screen line where the x (or y,
+// with `vertical`) coordinate is `limit`, keeping the side where `sign` times
+// its distance is positive.
+static int clipScreenPolygon(const ScreenVertex *in, int count, ScreenVertex *out, bool vertical, float limit, float sign)
+{
+    int outCount = 0;
+
+    ScreenVertex prev = in[count - 1];
+    float prevDist = sign * ((vertical ? prev.y : prev.x) - limit);
+
+    for (int i = 0; i < count; i++) {
+        ScreenVertex cur = in[i];
+        float curDist = sign * ((vertical ? cur.y : cur.x) - limit);
+
+        if ((prevDist >= 0.0f) != (curDist >= 0.0f)) {
+            float t = prevDist / (prevDist - curDist);
+            ScreenVertex v;
+            v.x = prev.x + (cur.x - prev.x) * t;
+            v.y = prev.y + (cur.y - prev.y) * t;
+            for (int k = 0; k < 3; k++) {
+                v.values[k] = prev.values[k] + (cur.values[k] - prev.values[k]) * t;
+            }
+            out[outCount++] = v;
+        }
+        if (curDist >= 0.0f) {
+            out[outCount++] = cur;
+        }
+
+        prev = cur;
+        prevDist = curDist;
+    }
+
+    return outCount;
+}
+
+// Clips a triangle given in screen coordinates to the widest guard band, so
+// that the rasterizer's fixed point stays in range however large it is.
+// `polygon` holds the triangle and room for MAX_CLIP_POLYGON + 1 vertices.
+// Returns the vertex count of the convex polygon left in it.
+static int clipToGuardBand(ScreenVertex *polygon)
 {
-    for (int i = 0; i < SCREEN_HEIGHT * SCREEN_WIDTH; i++) {
-        platform.depthBuffer[i] = MIN_FLOAT;
+    const float minX = 0.5f * (1.0f - MAX_GUARD_BAND) * SCREEN_WIDTH;
+    const float maxX = 0.5f * (1.0f + MAX_GUARD_BAND) * SCREEN_WIDTH;
+    const float minY = 0.5f * (1.0f - MAX_GUARD_BAND) * SCREEN_HEIGHT;
+    const float maxY = 0.5f * (1.0f + MAX_GUARD_BAND) * SCREEN_HEIGHT;
+
+    bool inside = true;
+    for (int i = 0; i < 3; i++) {
+        if (!(fabsf(polygon[i].x) <= MAX_SCREEN_COORDINATE && fabsf(polygon[i].y) <= MAX_SCREEN_COORDINATE)) {
+            return 0;
+        }
+        inside = inside && polygon[i].x >= minX && polygon[i].x <= maxX
+                        && polygon[i].y >= minY && polygon[i].y <= maxY;
+    }
+    if (inside) {
+        return 3;
     }
 
-    return 0;
+    ScreenVertex clipped[MAX_CLIP_POLYGON + 1];
+    int count = clipScreenPolygon(polygon, 3, clipped, false, minX, 1.0f);
+    count = count < 3 ? 0 : clipScreenPolygon(clipped, count, polygon, false, maxX, -1.0f);
+    count = count < 3 ? 0 : clipScreenPolygon(polygon, count, clipped, true, minY, 1.0f);
+    count = count < 3 ? 0 : clipScreenPolygon(clipped, count, polygon, true, maxY, -1.0f);
+    return count < 3 ? 0 : count;
 }
 
-int EndDrawing()
+void FillTriangleV(Vector4 p1, Vector4 p2, Vector4 p3, SDL_Color color)
 {
-    SDL_BlitSurface(platform.screen, NULL, platform.video, NULL);
-    SDL_Flip(platform.video);
+    flushDrawCommands();
+    ensureDepthCleared();
+    lockScreen();
+
+    ScreenVertex polygon[MAX_CLIP_POLYGON + 1] = {
+        { p1.x, p1.y, { p1.z, 0.0f, 0.0f } },
+        { p2.x, p2.y, { p2.z, 0.0f, 0.0f } },
+        { p3.x, p3.y, { p3.z, 0.0f, 0.0f } },
+    };
+    int count = clipToGuardBand(polygon);
 
-    PollInputEvents();
+    Vector4 first = { polygon[0].x, polygon[0].y, polygon[0].values[0], 1.0f };
+    for (int i = 1; i + 1 < count; i++) {
+        Vector4 second = { polygon[i].x, polygon[i].y, polygon[i].values[0], 1.0f };
+        Vector4 third = { polygon[i + 1].x, polygon[i + 1].y, polygon[i + 1].values[0], 1.0f };
 
-    return 0;
+        RasterTriangle tri;
+        if (setupRasterTriangle(&tri, first, second, third, NULL, color)) {
+            markDirty(tri.minX, tri.minY, tri.maxX - tri.minX + 1, tri.maxY - tri.minY + 1);
+            rasterizeTriangle(&tri, 0, 0, platform.renderWidth, platform.renderHeight);
+        }
+    }
 }
 
-void DrawRectangle(SDL_Rect *rect, SDL_Color color)
+// Narrows [*minX, *maxX] to the pixels of row `y` on the inside of `edge`
+static inline void clipSpanToEdge(const RasterEdge *edge, int y, int *minX, int *maxX)
 {
-    SDL_FillRect(platform.screen, rect, SDL_MapRGB(platform.screen->format, color.r, color.g, color.b));
+    int e = edge->origin + edge->stepY * y;
+
+    if (edge->stepX > 0) {
+        // e + stepX * x >= 0, rounded up
+        int x = e >= 0 ? -(e / edge->stepX) : (-e + edge->stepX - 1) / edge->stepX;
+        *minX = MAX(*minX, x);
+    } else if (edge->stepX < 0) {
+        // e + stepX * x >= 0, rounded down
+        int step = -edge->stepX;
+        int x = e >= 0 ? e / step : -((-e + step - 1) / step);
+        *maxX = MIN(*maxX, x);
+    } else if (e < 0) {
+        *maxX = *minX - 1;
+    }
 }
 
-void DrawImage(SDL_Surface *image)
+// Draws a span of `count` pixels. u and v are 16.16 fixed point texel
+// coordinates, wrapped at the texture's stored size. The tiled loop computes
+// the same addresses as TextureOffset.
+// `t` moved by whole repeats of `size` into [0, size), which samples the same
+// texel through the wrap mask
+static inline float wrapTexel(float t, float size)
 {
-    SDL_BlitSurface(image, NULL, platform.screen, NULL);
+    return t - floorf(t / size) * size;
 }
 
-void DrawTextEx(TTF_Font *font, const char *text, Vector2 position, SDL_Color color)
+static inline __attribute__((always_inline)) void drawTexturedSpan(
+    Pixel *row, void *depthRow, int count, float z, float dzdx,
+    int u, int v, int du, int dv, const Texture *tex, int format)
 {
-    SDL_Surface *textSurface = TTF_RenderUTF8_Solid(font, text, color);
-    SDL_Rect target = {
-        (Sint16)position.x,
-        (Sint16)position.y,
-        0,
-        0,
-    };
-    SDL_BlitSurface(textSurface, NULL, platform.screen, &target);
-    SDL_FreeSurface(textSurface);
-}
-
-void DrawPixelDepth(int x, int y, float w, SDL_Color color) {
-    if (
-           x < 0 || x + 1 > SCREEN_WIDTH
-        || y < 0 || y + 1 > SCREEN_HEIGHT
-    ) {
+    const Pixel *texels = tex->pixels;
+    int maskU = (1 << tex->widthShift) - 1;
+    int maskV = (1 << tex->heightShift) - 1;
+    int shift = tex->widthShift;
+
+    if (tex->tiled) {
+        const int tileMask = TEXTURE_TILE - 1;
+        for (int i = 0; i < count; i++) {
+            if (testWriteDepth(depthRow, i, z, format)) {
+                int tu = (u >> 16) & maskU, tv = (v >> 16) & maskV;
+                row[i] = texels[((tv & ~tileMask) << shift) | ((tu & ~tileMask) << TEXTURE_TILE_SHIFT)
+                              | ((tv & tileMask) << TEXTURE_TILE_SHIFT) | (tu & tileMask)];
+            }
+            u += du;
+            v += dv;
+            z += dzdx;
+        }
         return;
     }
-    if (w > platform.depthBuffer[y * SCREEN_WIDTH + x]) {
-        Uint32 *pixels = (Uint32*)platform.screen->pixels;
-        pixels[ (y * platform.screen->w) + x ] = SDL_MapRGB(platform.screen->format, color.r, color.g, color.b);
 
-        platform.depthBuffer[y * SCREEN_WIDTH + x] = w;
+    for (int i = 0; i < count; i++) {
+        if (testWriteDepth(depthRow, i, z, format)) {
+            row[i] = texels[(((v >> 16) & maskV) << shift) | ((u >> 16) & maskU)];
+        }
+        u += du;
+        v += dv;
+        z += dzdx;
     }
 }
 
-void DrawPixel(int x, int y, SDL_Color color) {
-    DrawPixelDepth(x, y, MAX_FLOAT, color);
-}
+// Draws a triangle of DrawTexturedTriangle, clipped to the guard band. The
+// vertex values are 1/w, u/w and v/w, with u and v in texels.
+static void drawTexturedTriangle(const ScreenVertex *a, const ScreenVertex *b, const ScreenVertex *c, const Texture *tex)
+{
+    int x0s = toSubpixel(a->x), y0s = toSubpixel(a->y);
+    int x1s = toSubpixel(b->x), y1s = toSubpixel(b->y);
+    int x2s = toSubpixel(c->x), y2s = toSubpixel(c->y);
 
-void PutPixelDepth(int x, int y, float w, Uint32 pixel) {
-    if (
-           x < 0 || x + 1 > SCREEN_WIDTH
-        || y < 0 || y + 1 > SCREEN_HEIGHT
-    ) {
+    int area = (x1s - x0s) * (y2s - y0s) - (y1s - y0s) * (x2s - x0s);
+    if (area == 0) {
+        return;
+    }
+    if (area < 0) {
+        SWAP(x1s, x2s, int);
+        SWAP(y1s, y2s, int);
+        SWAP(b, c, const ScreenVertex*);
+    }
+
+    int minX = MAX(MIN(x0s, MIN(x1s, x2s)) >> SUBPIXEL_BITS, 0);
+    int minY = MAX(MIN(y0s, MIN(y1s, y2s)) >> SUBPIXEL_BITS, 0);
+    int maxX = MIN(MAX(x0s, MAX(x1s, x2s)) >> SUBPIXEL_BITS, platform.renderWidth - 1);
+    int maxY = MIN(MAX(y0s, MAX(y1s, y2s)) >> SUBPIXEL_BITS, platform.renderHeight - 1);
+    if (minX > maxX || minY > maxY) {
         return;
     }
 
-    if (w > platform.depthBuffer[y * SCREEN_WIDTH + x]) {
-        Uint32 *pixels = (Uint32*)platform.screen->pixels;
-        pixels[ (y * platform.screen->w) + x ] = pixel;
+    RasterEdge edges[3] = {
+        makeRasterEdge(x1s, y1s, x2s, y2s),
+        makeRasterEdge(x2s, y2s, x0s, y0s),
+        makeRasterEdge(x0s, y0s, x1s, y1s),
+    };
 
-        platform.depthBuffer[y * SCREEN_WIDTH + x] = w;
+    float iw0 = a->values[0], iw1 = b->values[0], iw2 = c->values[0];
+    RasterPlane invW = makeRasterPlane(x0s, y0s, x1s, y1s, x2s, y2s, iw0, iw1, iw2);
+    RasterPlane uOverW = makeRasterPlane(x0s, y0s, x1s, y1s, x2s, y2s, a->values[1], b->values[1], c->values[1]);
+    RasterPlane vOverW = makeRasterPlane(x0s, y0s, x1s, y1s, x2s, y2s, a->values[2], b->values[2], c->values[2]);
+
+    // Depth (-z / w) is linear in 1/w under the current projection
+    float zBase = encodeDepth(platform.depthBase - renderState.projMatrix.m[2][2]);
+    float zScale = -renderState.projMatrix.m[3][2] * platform.depthScale;
+    float dzdx = zScale * invW.dx;
+
+    // Skip triangles behind every block they cover, and keep the
+    // hierarchical Z upper bounds valid for those that get drawn
+    float zNear = zBase + zScale * MAX(iw0, MAX(iw1, iw2));
+    zNear += DEPTH_SLACK * (fabsf(zNear) + fabsf(dzdx) * SCREEN_WIDTH + fabsf(zScale * invW.dy) * SCREEN_HEIGHT);
+    float hiddenBelow = MAX_FLOAT;
+    for (int by = minY / RASTER_BLOCK; by <= maxY / RASTER_BLOCK; by++) {
+        for (int bx = minX / RASTER_BLOCK; bx <= maxX / RASTER_BLOCK; bx++) {
+            hiddenBelow = MIN(hiddenBelow, platform.depthBlockMin[by * DEPTH_BLOCKS_X + bx]);
+        }
+    }
+    if (zNear <= hiddenBelow) {
+        return;
+    }
+    for (int by = minY / RASTER_BLOCK; by <= maxY / RASTER_BLOCK; by++) {
+        for (int bx = minX / RASTER_BLOCK; bx <= maxX / RASTER_BLOCK; bx++) {
+            float *blockMax = &platform.depthBlockMax[by * DEPTH_BLOCKS_X + bx];
+            *blockMax = MAX(*blockMax, zNear);
+        }
     }
-}
 
-void PutPixel(int x, int y, Uint32 pixel) {
-    PutPixelDepth(x, y, MAX_FLOAT, pixel);
-}
+    markDirty(minX, minY, maxX - minX + 1, maxY - minY + 1);
+    lockScreen();
+    Pixel *pixels = (Pixel*)platform.screen->pixels;
+    int pitch = platform.screen->pitch / sizeof(Pixel);
+    int format = platform.depthFormat;
+    float sizeU = (float)(1 << tex->widthShift);
+    float sizeV = (float)(1 << tex->heightShift);
+
+    for (int y = minY; y <= maxY; y++) {
+        int startX = minX, endX = maxX;
+        for (int k = 0; k < 3; k++) {
+            clipSpanToEdge(&edges[k], y, &startX, &endX);
+        }
+        if (startX > endX) {
+            continue;
+        }
 
-void DrawLine(int startPosX, int startPosY, int endPosX, int endPosY, SDL_Color color)
-{
-    double x = endPosX - startPosX; 
-    double y = endPosY - startPosY; 
-    double rLength = Q_rsqrt(x*x + y*y);
-    double addx = x * rLength;
-    double addy = y * rLength;
-    x = startPosX; 
-    y = startPosY; 
+        Pixel *row = pixels + y * pitch;
+        Uint8 *depthRow = (Uint8*)depthRowAt(y, format);
+
+        float iw = rasterPlaneAt(&invW, startX, y);
+        float uw = rasterPlaneAt(&uOverW, startX, y);
+        float vw = rasterPlaneAt(&vOverW, startX, y);
+        float w = 1.0f / iw;
+        float u = uw * w, v = vw * w;
+
+        for (int x = startX; x <= endX; x += TEXTURE_SPAN) {
+            int count = MIN(TEXTURE_SPAN, endX - x + 1);
+
+            // Perspective-correct at both ends of the span, linear in between
+            float iwEnd = iw + invW.dx * count;
+            float uwEnd = uw + uOverW.dx * count;
+            float vwEnd = vw + vOverW.dx * count;
+            float wEnd = 1.0f / iwEnd;
+            float uEnd = uwEnd * wEnd, vEnd = vwEnd * wEnd;
+
+            // Repeats are taken off so that 16.16 fixed point holds the
+            // coordinates, and spans minified past any sensible rate are
+            // clamped for the same reason
+            float su = wrapTexel(u, sizeU), sv = wrapTexel(v, sizeV);
+            float spanU = CLAMP(uEnd - u, -MAX_SPAN_TEXELS, MAX_SPAN_TEXELS);
+            float spanV = CLAMP(vEnd - v, -MAX_SPAN_TEXELS, MAX_SPAN_TEXELS);
+
+            float step = 65536.0f / (float)count;
+            #define DRAW_SPAN(format) drawTexturedSpan(row + x, depthRow + x * depthBytes(format), count, \
+                zBase + zScale * iw, dzdx, (int)(su * 65536.0f), (int)(sv * 65536.0f), \
+                (int)(spanU * step), (int)(spanV * step), tex, format)
+            switch (format) {
+            case DEPTH_FORMAT_FIXED16: DRAW_SPAN(DEPTH_FORMAT_FIXED16); break;
+            case DEPTH_FORMAT_INT24: DRAW_SPAN(DEPTH_FORMAT_INT24); break;
+            default: DRAW_SPAN(DEPTH_FORMAT_FLOAT32); break;
+            }
+            #undef DRAW_SPAN
 
-    for (int i = 0; i < 1.0f / rLength; i++) { 
-        DrawPixel(x, y, color); 
-        x += addx; 
-        y += addy; 
-    } 
+            iw = iwEnd;
+            uw = uwEnd;
+            vw = vwEnd;
+            u = uEnd;
+            v = vEnd;
+        }
+    }
 }
 
-void DrawTriangle(Triangle3d triangle, SDL_Color color) {
-    Vector4 points1 = triangle.points[0];
-    Vector4 points2 = triangle.points[1];
-    Vector4 points3 = triangle.points[2];
-    
-    DrawLine(
-        points1.x, points1.y,
-        points2.x, points2.y, color);
-    DrawLine(
-        points2.x, points2.y,
-        points3.x, points3.y, color);
-    DrawLine(
-        points3.x, points3.y,
-        points1.x, points1.y, color);
-}
-
-/* unfinished */
 void DrawTexturedTriangle(
     int x1, int y1, float u1, float v1, float w1,
     int x2, int y2, float u2, float v2, float w2,
     int x3, int y3, float u3, float v3, float w3,
-    SDL_Surface *tex
+    const Texture *tex
 ) {
-    if (y2 < y1) {
-        SWAP(y1, y2, int);
-        SWAP(x1, x2, int);
-        SWAP(u1, u2, float);
-        SWAP(v1, v2, float);
-        SWAP(w1, w2, float);
-    }
-    if (y3 < y1) {
-        SWAP(y1, y3, int);
-        SWAP(x1, x3, int);
-        SWAP(u1, u3, float);
-        SWAP(v1, v3, float);
-        SWAP(w1, w3, float);
-    }
-    if (y3 < y2) {
-        SWAP(y2, y3, int);
-        SWAP(x2, x3, int);
-        SWAP(u2, u3, float);
-        SWAP(v2, v3, float);
-        SWAP(w2, w3, float);
-    }
-
-    int dy1   = y2 - y1;
-    int dx1   = x2 - x1;
-    float dv1 = v2 - v1;
-    float du1 = u2 - u1;
-    float dw1 = w2 - w1;
-
-    int dy2   = y3 - y1;
-    int dx2   = x3 - x1;
-
-    float dv2 = v3 - v1;
-    float du2 = u3 - u1;
-    float dw2 = w3 - w1;
-
-    float texU, texV, texW;
-
-    float daxStep = 0, dbxStep = 0,
-          du1Step = 0, dv1Step = 0,
-          du2Step = 0, dv2Step = 0,
-          dw1Step = 0, dw2Step = 0;
-
-    if (dy1) daxStep = dx1 / (float)abs(dy1);
-    if (dy2) dbxStep = dx2 / (float)abs(dy2);
-
-    if (dy1) du1Step = du1 / (float)abs(dy1);
-    if (dy1) dv1Step = dv1 / (float)abs(dy1);
-    if (dy1) dw1Step = dw1 / (float)abs(dy1);
-
-    if (dy2) du2Step = du2 / (float)abs(dy2);
-    if (dy2) dv2Step = dv2 / (float)abs(dy2);
-    if (dy2) dw2Step = dw2 / (float)abs(dw2);
-
-    Uint32* pixels = (Uint32*)tex->pixels;
-
-    if (dy1) {
-        for (int i = y1; i <= y2; i++) {
-            int ax = x1 + (float)(i - y1) * daxStep;
-            int bx = x1 + (float)(i - y1) * dbxStep;
-
-            float texSu = u1  + (float)(i - y1) * du1Step;
-            float texSv = v1  + (float)(i - y1) * dv1Step;
-            float texSw = w1  + (float)(i - y1) * dw1Step;
-
-            float texEu = u1  + (float)(i - y1) * du2Step;
-            float texEv = v1  + (float)(i - y1) * dv2Step;
-            float texEw = w1  + (float)(i - y1) * dw2Step;
-
-            if (ax > bx) {
-                SWAP(ax, bx, int);
-                SWAP(texSu, texEu, float);
-                SWAP(texSv, texEv, float);
-                SWAP(texSw, texEw, float);
-            }
-
-            texU = texSu;
-            texV = texSv;
-            texW = texSw;
-
-            float tStep = 1.0f / (float)(bx - ax);
-            float t = 0.0f;
+    flushDrawCommands();
+    ensureDepthCleared();
+    if (w1 <= 0.0f || w2 <= 0.0f || w3 <= 0.0f) {
+        return;
+    }
 
-            for (int j = ax; j < bx; j++) {
-                texU = (1.0f - t) * texSu + t * texEu;
-                texV = (1.0f - t) * texSv + t * texEv;
-                texW = (1.0f - t) * texSv + t * texEv;
+    // 1/w, u/w and v/w are linear in screen space, u and v themselves are not.
+    // Texture coordinates are in texels from here on.
+    float iw1 = 1.0f / w1, iw2 = 1.0f / w2, iw3 = 1.0f / w3;
+    ScreenVertex polygon[MAX_CLIP_POLYGON + 1] = {
+        { (float)x1, (float)y1, { iw1, u1 * tex->width * iw1, v1 * tex->height * iw1 } },
+        { (float)x2, (float)y2, { iw2, u2 * tex->width * iw2, v2 * tex->height * iw2 } },
+        { (float)x3, (float)y3, { iw3, u3 * tex->width * iw3, v3 * tex->height * iw3 } },
+    };
+    int count = clipToGuardBand(polygon);
 
-                float sx = (texU / texW) * tex->w;
-                float sy = (texV / texW) * tex->h;
+    for (int i = 1; i + 1 < count; i++) {
+        drawTexturedTriangle(&polygon[0], &polygon[i], &polygon[i + 1], tex);
+    }
+}
 
-                int coord = (int)(sy * tex->w + sx);
+// `shades` as for setupRasterTriangle, `color` is only used without them
+static void queueRasterTriangle(Vector4 p1, Vector4 p2, Vector4 p3, const float *shades, SDL_Color color)
+{
+    RasterTriangle tri;
+    if (setupRasterTriangle(&tri, p1, p2, p3, shades, color)) {
+        kv_push(RasterTriangle, renderState.rasterTriangles, tri);
+    }
+}
 
-                if (texW > platform.depthBuffer[i * SCREEN_WIDTH + j])
-                {
-                    PutPixel(j, i, pixels[coord]);
-                    // Draw(j, i, tex->SampleGlyph(tex_u / tex_w, tex_v / tex_w), tex->SampleColour(tex_u / tex_w, tex_v / tex_w));
-                    platform.depthBuffer[i * SCREEN_WIDTH + j] = texW;
-                }
+static void rasterizeTile(int tile)
+{
+    int tileX = (tile % RASTER_TILES_X) * RASTER_TILE;
+    int tileY = (tile / RASTER_TILES_X) * RASTER_TILE;
+    int tileMaxX = MIN(tileX + RASTER_TILE, platform.renderWidth);
+    int tileMaxY = MIN(tileY + RASTER_TILE, platform.renderHeight);
+
+    for (size_t i = 0; i < kv_size(renderState.tileBins[tile]); i++) {
+        const RasterTriangle *tri = &kv_A(renderState.rasterTriangles, kv_A(renderState.tileBins[tile], i));
+        rasterizeTriangle(tri, tileX, tileY, tileMaxX, tileMaxY);
+    }
 
-                t += tStep;
+    // Refresh the tile's lower bound for the next batch
+    if (kv_size(renderState.tileBins[tile]) > 0) {
+        float tileMin = MAX_FLOAT;
+        for (int by = tileY / RASTER_BLOCK; by < (tileMaxY + RASTER_BLOCK - 1) / RASTER_BLOCK; by++) {
+            for (int bx = tileX / RASTER_BLOCK; bx < (tileMaxX + RASTER_BLOCK - 1) / RASTER_BLOCK; bx++) {
+                tileMin = MIN(tileMin, platform.depthBlockMin[by * DEPTH_BLOCKS_X + bx]);
             }
         }
+        platform.depthTileMin[tile] = tileMin;
     }
+}
 
-    dy1 = y3 - y2;
-    dx1 = x3 - x2;
-    dv1 = v3 - v2;
-    du1 = u3 - u2;
-    if (dy1) daxStep = dx1 / (float)abs(dy1);
-    if (dy2) dbxStep = dx2 / (float)abs(dy2);
-
-    du1Step = 0; dv1Step = 0;
-    if (dy1) du1Step = du1 / (float)abs(dy1);
-    if (dy1) dv1Step = dv1 / (float)abs(dy1);
-
-    if (dy1) {
-        for (int i = y2; i <= y3; i ++) {
-            int ax = x2 + (float)(i - y2) * daxStep;
-            int bx = x1 + (float)(i - y1) * dbxStep;
-
-            float texSu = u2 + (float)(i - y2) * du1Step;
-            float texSv = v2 + (float)(i - y2) * dv1Step;
-
-            float texEu = u1 + (float)(i - y1) * du2Step;
-            float texEv = v1 + (float)(i - y1) * dv2Step;
+// Tiles are handed out first come, first served. Every tile is rasterized by
+// a single thread in submission order, so the image matches a serial render.
+static void rasterizeTiles()
+{
+    for (;;) {
+        int tile = __sync_fetch_and_add(&rasterWorkers.nextTile, 1);
+        if (tile >= RASTER_TILE_COUNT) {
+            break;
+        }
+        rasterizeTile(tile);
+    }
+}
 
-            if (ax > bx) {
-                SWAP(ax, bx, int);
-                SWAP(texSu, texEu, float);
-                SWAP(texSv, texEv, float);
-            }
+static void *rasterWorkerMain(void *arg)
+{
+    (void)arg;
+    int generation = 0;
 
-            texU = texSu;
-            texV = texSv;
+    pthread_mutex_lock(&rasterWorkers.lock);
+    for (;;) {
+        while (!rasterWorkers.quit && rasterWorkers.generation == generation) {
+            pthread_cond_wait(&rasterWorkers.wake, &rasterWorkers.lock);
+        }
+        if (rasterWorkers.quit) {
+            break;
+        }
+        generation = rasterWorkers.generation;
+        pthread_mutex_unlock(&rasterWorkers.lock);
 
-            float tStep = 1.0f / (float)(bx - ax);
-            float t = 0.0f;
+        rasterizeTiles();
 
-            for (int j = ax; j < bx; j++) {
-                texU = (1.0f - t) * texSu + t * texEu;
-                texV = (1.0f - t) * texSv + t * texEv;
+        pthread_mutex_lock(&rasterWorkers.lock);
+        if (--rasterWorkers.busy == 0) {
+            pthread_cond_signal(&rasterWorkers.done);
+        }
+    }
+    pthread_mutex_unlock(&rasterWorkers.lock);
 
-                float sx = texU * tex->w;
-                float sy = texV * tex->h;
+    return NULL;
+}
 
-                int coord = (int)(sy * tex->w + sx);
+static void StartRasterWorkers()
+{
+    pthread_mutex_init(&rasterWorkers.lock, NULL);
+    pthread_cond_init(&rasterWorkers.wake, NULL);
+    pthread_cond_init(&rasterWorkers.done, NULL);
 
-                PutPixel(j, i, pixels[coord]);
+    // The main thread rasterizes too, so one worker less than there are cores
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = CLAMP((int)cores - 1, 0, MAX_RASTER_THREADS);
 
-                t += tStep;
-            }
+    for (int i = 0; i < count; i++) {
+        if (pthread_create(&rasterWorkers.threads[i], NULL, rasterWorkerMain, NULL) != 0) {
+            break;
         }
+        rasterWorkers.threadCount++;
     }
 }
 
-void FillTriangle(
-    int x1, int y1, float w1,
-    int x2, int y2, float w2,
-    int x3, int y3, float w3,
-    SDL_Color color
-) {
-    if (y2 < y1) {
-        SWAP(y1, y2, int);
-        SWAP(x1, x2, int);
-        SWAP(w1, w2, float);
-    }
-    if (y3 < y1) {
-        SWAP(y1, y3, int);
-        SWAP(x1, x3, int);
-        SWAP(w1, w3, float);
-    }
-    if (y3 < y2) {
-        SWAP(y2, y3, int);
-        SWAP(x2, x3, int);
-        SWAP(w2, w3, float);
-    }
-
-    int dy1 = y2 - y1;
-    int dx1 = x2 - x1;
-
-    float dw1 = w2 - w1;
-
-    int dy2 = y3 - y1;
-    int dx2 = x3 - x1;
-
-    float dw2 = w3 - w1;
+static void StopRasterWorkers()
+{
+    pthread_mutex_lock(&rasterWorkers.lock);
+    rasterWorkers.quit = true;
+    pthread_cond_broadcast(&rasterWorkers.wake);
+    pthread_mutex_unlock(&rasterWorkers.lock);
 
-    float texU, texV, texW;
+    for (int i = 0; i < rasterWorkers.threadCount; i++) {
+        pthread_join(rasterWorkers.threads[i], NULL);
+    }
+    rasterWorkers.threadCount = 0;
 
-    float daxStep = 0, dbxStep = 0;
+    pthread_cond_destroy(&rasterWorkers.done);
+    pthread_cond_destroy(&rasterWorkers.wake);
+    pthread_mutex_destroy(&rasterWorkers.lock);
+}
 
-    float dw1Step = 0, dw2Step = 0;
+static void flushWireLines()
+{
+    size_t count = kv_size(renderState.wireLines) / 2;
+    if (count > 0) {
+        SDL_Color color = renderState.wireColor;
+        drawLineBatch(renderState.wireLines.a, (int)count, SDL_MapRGB(platform.screen->format, color.r, color.g, color.b), true);
+        kv_empty(renderState.wireLines);
+    }
+}
 
-    if (dy1) daxStep = dx1 / (float)abs(dy1);
-    if (dy2) dbxStep = dx2 / (float)abs(dy2);
+// Bins the queued triangles into screen tiles and rasterizes all tiles,
+// spread over the worker threads and the calling thread
+static void flushRasterTriangles()
+{
+    size_t count = kv_size(renderState.rasterTriangles);
+    if (count == 0) {
+        flushWireLines();
+        return;
+    }
 
-    if (dy1) dw1Step = dw1 / (float)abs(dy1);
-    if (dy2) dw2Step = dw2 / (float)abs(dy2);
+    for (int i = 0; i < RASTER_TILE_COUNT; i++) {
+        kv_empty(renderState.tileBins[i]);
+    }
 
-    if (dy1) {
-        for (int i = y1; i <= y2; i++) {
-            int ax = x1 + (float)(i - y1) * daxStep;
-            int bx = x1 + (float)(i - y1) * dbxStep;
+    for (size_t i = 0; i < count; i++) {
+        const RasterTriangle *tri = &kv_A(renderState.rasterTriangles, i);
+        int tileMinX = tri->minX / RASTER_TILE, tileMaxX = tri->maxX / RASTER_TILE;
+        int tileMinY = tri->minY / RASTER_TILE, tileMaxY = tri->maxY / RASTER_TILE;
 
-            float texSw = w1 + (float)(i - y1) * dw1Step;
-            float texEw = w1 + (float)(i - y1) * dw2Step;
+        float zNearest = tri->zMax + tri->zSlack;
 
-            if (ax > bx) {
-                SWAP(ax, bx, int);
-                SWAP(texSw, texEw, float);
+        for (int ty = tileMinY; ty <= tileMaxY; ty++) {
+            for (int tx = tileMinX; tx <= tileMaxX; tx++) {
+                int tile = ty * RASTER_TILES_X + tx;
+                // Hidden behind everything drawn to the tile by earlier batches
+                if (zNearest <= platform.depthTileMin[tile]) {
+                    continue;
+                }
+                kv_push(int, renderState.tileBins[tile], (int)i);
             }
+        }
+    }
 
-            texW = texSw;
-
-            float tstep = 1.0f / ((float)(bx - ax));
-            float t = 0.0f;
-
-            for (int j = ax; j < bx; j++) {
-                texW = (1.0f - t) * texSw + t * texEw;
-                DrawPixelDepth(j, i, texW, color);
-                t += tstep;
+    if (platform.dirtyTracking) {
+        for (int i = 0; i < RASTER_TILE_COUNT; i++) {
+            if (kv_size(renderState.tileBins[i]) > 0) {
+                markDirty((i % RASTER_TILES_X) * RASTER_TILE, (i / RASTER_TILES_X) * RASTER_TILE, RASTER_TILE, RASTER_TILE);
             }
         }
     }
 
-    dx1 = x3 - x2;
-    dy1 = y3 - y2;
-    dw1 = w3 - w2;
-
-    if (dy1) daxStep = dx1 / (float)abs(dy1);
-    if (dy2) dbxStep = dx2 / (float)abs(dy2);
+    lockScreen();
+    rasterWorkers.nextTile = 0;
 
-    if (dy1) dw1Step = dw1 / (float)abs(dy1);
-
-    if (dy1) {
-        for (int i = y2; i <= y3; i ++) {
-            int ax = x2 + (float)(i - y2) * daxStep;
-            int bx = x1 + (float)(i - y1) * dbxStep;
-
-            float texSw = w2 + (float)(i - y2) * dw1Step;
-            float texEw = w1 + (float)(i - y1) * dw2Step;
-
-            if (ax > bx) {
-                SWAP(ax, bx, int);
-                SWAP(texSw, texEw, float);
-            }
-
-            texW = texSw;
+    if (rasterWorkers.threadCount > 0) {
+        pthread_mutex_lock(&rasterWorkers.lock);
+        rasterWorkers.busy = rasterWorkers.threadCount;
+        rasterWorkers.generation++;
+        pthread_cond_broadcast(&rasterWorkers.wake);
+        pthread_mutex_unlock(&rasterWorkers.lock);
+    }
 
-            float tstep = 1.0f / ((float)(bx - ax));
-            float t = 0.0f;
+    rasterizeTiles();
 
-            for (int j = ax; j < bx; j++) {
-                texW = (1.0f - t) * texSw + t * texEw;
-                DrawPixelDepth(j, i, texW, color);
-                t += tstep;
-            }
+    if (rasterWorkers.threadCount > 0) {
+        pthread_mutex_lock(&rasterWorkers.lock);
+        while (rasterWorkers.busy > 0) {
+            pthread_cond_wait(&rasterWorkers.done, &rasterWorkers.lock);
         }
+        pthread_mutex_unlock(&rasterWorkers.lock);
     }
+
+    kv_empty(renderState.rasterTriangles);
+    flushWireLines();
+}
+
+void FillTriangle(
+    int x1, int y1, float w1,
+    int x2, int y2, float w2,
+    int x3, int y3, float w3,
+    SDL_Color color
+) {
+    FillTriangleV(
+        (Vector4){ (float)x1, (float)y1, w1, 1.0f },
+        (Vector4){ (float)x2, (float)y2, w2, 1.0f },
+        (Vector4){ (float)x3, (float)y3, w3, 1.0f },
+        color
+    );
 }
 
 void CameraMoveForward(Camera3d* camera, float distance) {
@@ -573,6 +2882,8 @@ void CameraYaw(Camera3d *camera, float angle)
 }
 
 void BeginMode3d(Camera3d *camera) {
+    flushDrawCommands();
+
     Matrix4 viewMatrix = Matrix_LookAt(&camera->position, &camera->target, &camera->up);
     Matrix4 projMatrix = Matrix_MakeProjection(camera->fovy, (float)SCREEN_HEIGHT / (float)SCREEN_WIDTH, 0.1f, 1000.0f);
 
@@ -580,18 +2891,57 @@ void BeginMode3d(Camera3d *camera) {
     renderState.projMatrix = projMatrix;
 
     renderState.camera = *camera;
+    renderState.mode3d = true;
+
+    // Clip space tests like -w <= x become planes in world space through
+    // the columns of the view/projection matrix
+    Matrix4 viewProj = Matrix_MultiplyMatrix(&viewMatrix, &projMatrix);
+    renderState.viewProjMatrix = viewProj;
+    float signs[FRUSTUM_PLANES] = { 1.0f, 1.0f, -1.0f, 1.0f, -1.0f, -1.0f };
+    int axes[FRUSTUM_PLANES] = { 2, 0, 0, 1, 1, 2 };
+    for (int i = 0; i < FRUSTUM_PLANES; i++) {
+        // The near plane is z >= 0, the others are w +- axis >= 0
+        float w = i == FRUSTUM_NEAR ? 0.0f : 1.0f;
+        float plane[4];
+        for (int k = 0; k < 4; k++) {
+            plane[k] = w * viewProj.m[k][3] + signs[i] * viewProj.m[k][axes[i]];
+        }
+        float length = sqrtf(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+        renderState.frustum[i] = (Vector4){ plane[0] / length, plane[1] / length, plane[2] / length, plane[3] / length };
+    }
 }
 
 void EndMode3d() {
+    flushDrawCommands();
+    renderState.mode3d = false;
+
     // renderState.viewMatrix = NULL;
     // renderState.projMatrix = NULL;
     // renderState.camera = NULL;
 }
 
 void SetupLight(Vector3 light) {
+    flushDrawCommands();
     renderState.light = light;
 }
 
+void SetShadingMode(int mode) {
+    flushDrawCommands();
+    renderState.shadingMode = mode;
+}
+
+void SetDithering(bool enabled) {
+    flushDrawCommands();
+    renderState.dithering = enabled;
+    updateDithering();
+}
+
+void SetWireframe(bool enabled, SDL_Color color) {
+    flushDrawCommands();
+    renderState.wireframe = enabled;
+    renderState.wireColor = color;
+}
+
 Vector4 Vector_IntersectPlane(Vector4 plane_p, Vector4 plane_n, Vector4 *lineStart, Vector4 *lineEnd)
 {
     // VectorNormalize(&plane_n);
@@ -711,159 +3061,457 @@ int Triangle_ClipAgainstPlane(Vector4 plane_p, Vector4 plane_n, Triangle3d *in_t
     return 0;
 }
 
-void DrawModel(Mesh3d *mesh, Vector3 position) {
-    // if (!renderState.camera || !renderState.viewMatrix || !renderState.projMatrix) {
-    //     printf("Render was not set up!\n");
-    //     exit(1);
-    // }
-
-    // Matrix4 matRotZ = Matrix_MakeRotationZ(0.0f);
-    // Matrix4 matRotX = Matrix_MakeRotationX(0.0f);
-
-    Matrix4 matTrans = Matrix_MakeTranslation(position.x, position.y, position.z);
-
-    Matrix4 matWorld = IdentityMatrix(); // Form World Matrix
-    // matWorld = Matrix_MultiplyMatrix(&matRotZ, &matRotX); // Transform by rotation
-    matWorld = Matrix_MultiplyMatrix(&matWorld, &matTrans); // Transform by translation
-
-    kdq_empty(renderState.trinaglesDeque);
-    kv_empty(renderState.trianglesToRaster);
-
-    for (int i = 0; i < mesh->polygonCount; i++) {
-        Triangle3d tri = mesh->polygons[i];
-        Triangle3d triProjected = InitTriangle3d(), triTransformed = InitTriangle3d(), triViewed = InitTriangle3d();
-
-        // World Matrix Transform
-        triTransformed.points[0] = Matrix_MultiplyVector(matWorld, tri.points[0]);
-        triTransformed.points[1] = Matrix_MultiplyVector(matWorld, tri.points[1]);
-        triTransformed.points[2] = Matrix_MultiplyVector(matWorld, tri.points[2]);
-
-        Vector3 line1 = Vector3Sub(
-            MakeVector3FromVector4(triTransformed.points[1]),
-            MakeVector3FromVector4(triTransformed.points[0])
-        );
-        Vector3 line2 = Vector3Sub(
-            MakeVector3FromVector4(triTransformed.points[2]),
-            MakeVector3FromVector4(triTransformed.points[0])
-        );
-
-        Vector3 normal = Vector3CrossProduct(line1, line2);
-        normal = Vector3Normalize(&normal);
-        float lightIntensity = MAX(0.1f, Vector3DotProduct(renderState.light, normal));
-        tri.color = (SDL_Color){lightIntensity * 255, lightIntensity * 255, lightIntensity * 255};
-
-        Vector3 cameraRay = Vector3Sub(
-            MakeVector3FromVector4(triTransformed.points[0]),
-            renderState.camera.position
-        );
-
-        if (Vector3DotProduct(normal, cameraRay) < 0.0f) {
-            // Convert World Space --> View Space
-            triViewed.points[0] = Matrix_MultiplyVector(renderState.viewMatrix, triTransformed.points[0]);
-            triViewed.points[1] = Matrix_MultiplyVector(renderState.viewMatrix, triTransformed.points[1]);
-            triViewed.points[2] = Matrix_MultiplyVector(renderState.viewMatrix, triTransformed.points[2]);
-
-            int clippedTriangles = 0;
-            Triangle3d clipped[2] = { 0 };
-            clippedTriangles = Triangle_ClipAgainstPlane(
-                (Vector4){0.0f, 0.0f, 0.1f, 1.0f}, (Vector4){0.0f, 0.0f, 1.0f, 1.0f},
-                &triViewed, &clipped[0], &clipped[1]
-            );
-
-            for (int n = 0; n < clippedTriangles; n++) {
-                // Project triangles from 3D --> 2D
-                triProjected.points[0] = Matrix_MultiplyVector(renderState.projMatrix, clipped[n].points[0]);
-                triProjected.points[1] = Matrix_MultiplyVector(renderState.projMatrix, clipped[n].points[1]);
-                triProjected.points[2] = Matrix_MultiplyVector(renderState.projMatrix, clipped[n].points[2]);
-
-                // Scale into view
-                triProjected.points[0] = VectorDiv(triProjected.points[0], triProjected.points[0].w);
-                triProjected.points[1] = VectorDiv(triProjected.points[1], triProjected.points[1].w);
-                triProjected.points[2] = VectorDiv(triProjected.points[2], triProjected.points[2].w);
-
-                // X/Y are inverted so put them back
-                triProjected.points[0].x *= -1.0f;
-                triProjected.points[1].x *= -1.0f;
-                triProjected.points[2].x *= -1.0f;
-                triProjected.points[0].y *= -1.0f;
-                triProjected.points[1].y *= -1.0f;
-                triProjected.points[2].y *= -1.0f;
-                triProjected.points[0].z *= -1.0f;
-                triProjected.points[1].z *= -1.0f;
-                triProjected.points[2].z *= -1.0f;
-
-                // Offset verts into visible normalised space
-                Vector4 vOffsetView = { 1, 1, 0, 1.0f };
-                triProjected.points[0] = VectorAdd(triProjected.points[0], vOffsetView);
-                triProjected.points[1] = VectorAdd(triProjected.points[1], vOffsetView);
-                triProjected.points[2] = VectorAdd(triProjected.points[2], vOffsetView);
-                triProjected.points[0].x *= 0.5f * (float)SCREEN_WIDTH;
-                triProjected.points[0].y *= 0.5f * (float)SCREEN_HEIGHT;
-                triProjected.points[1].x *= 0.5f * (float)SCREEN_WIDTH;
-                triProjected.points[1].y *= 0.5f * (float)SCREEN_HEIGHT;
-                triProjected.points[2].x *= 0.5f * (float)SCREEN_WIDTH;
-                triProjected.points[2].y *= 0.5f * (float)SCREEN_HEIGHT;
-
-                triProjected.color = tri.color;
-
-                kv_push(Triangle3d, renderState.trianglesToRaster, triProjected);
-            }
+static void reserveVertexScratch(int count) {
+    if (renderState.vertexCapacity >= count) {
+        return;
+    }
+
+    // Rounded up so the batch transforms always see whole groups of 4
+    count = (count + 3) & ~3;
+    renderState.vertexScratch = (float*)realloc(renderState.vertexScratch,
+        (sizeof(float) * 8 + sizeof(unsigned short)) * count);
+    renderState.vertexCapacity = count;
+    renderState.shadedMesh = NULL;
+
+    float *p = renderState.vertexScratch;
+    for (int i = 0; i < 4; i++, p += count) renderState.clipVertices[i] = p;
+    for (int i = 0; i < 3; i++, p += count) renderState.screenVertices[i] = p;
+    renderState.vertexShades = p;
+    p += count;
+    renderState.clipCodes = (unsigned short*)p;
+}
+
+void SetGuardBand(float scale) {
+    renderState.guardBand = CLAMP(scale, 1.0f, MAX_GUARD_BAND);
+}
+
+static inline unsigned short clipOutcode(float x, float y, float z, float w, float band) {
+    float bw = band * w;
+    return (z < 0.0f ? CLIP_NEAR : 0)
+         | (x < -bw ? CLIP_LEFT : 0)
+         | (x > bw ? CLIP_RIGHT : 0)
+         | (y < -bw ? CLIP_BOTTOM : 0)
+         | (y > bw ? CLIP_TOP : 0);
+}
+
+// Same mapping as Matrix_ProjectPoints, for vertices created by clipping
+static Vector4 projectClipVertex(Vector4 v) {
+    float halfWidth = 0.5f * (float)platform.renderWidth;
+    float halfHeight = 0.5f * (float)platform.renderHeight;
+    float rw = 1.0f / v.w;
+
+    return (Vector4){
+        halfWidth - v.x * rw * halfWidth,
+        halfHeight - v.y * rw * halfHeight,
+        -(v.z * rw),
+        v.w,
+    };
+}
+
+// A clip-space vertex and its intensity level, which clipping interpolates
+// along with the position. The mesh's own vertices keep the screen position
+// Matrix_ProjectPoints gave them, so that edges shared with unclipped
+// triangles land on exactly the same pixels.
+typedef struct ClipVertex {
+    Vector4 position;
+    float shade;
+    bool projected;
+    Vector4 screen;
+} ClipVertex;
+
+static ClipVertex lerpClipVertex(ClipVertex a, ClipVertex b, float t) {
+    return (ClipVertex){
+        {
+            a.position.x + (b.position.x - a.position.x) * t,
+            a.position.y + (b.position.y - a.position.y) * t,
+            a.position.z + (b.position.z - a.position.z) * t,
+            a.position.w + (b.position.w - a.position.w) * t,
+        },
+        a.shade + (b.shade - a.shade) * t,
+        false,
+        { 0.0f, 0.0f, 0.0f, 0.0f },
+    };
+}
+
+// One pass of Sutherland-Hodgman in homogeneous clip space. A vertex v is
+// inside when dot(plane, v) >= 0. Returns the new vertex count.
+static int clipPolygonAgainstPlane(const ClipVertex *in, int count, ClipVertex *out, Vector4 plane) {
+    int outCount = 0;
+
+    ClipVertex prev = in[count - 1];
+    Vector4 v = prev.position;
+    float prevDist = plane.x * v.x + plane.y * v.y + plane.z * v.z + plane.w * v.w;
+
+    for (int i = 0; i < count; i++) {
+        ClipVertex cur = in[i];
+        v = cur.position;
+        float curDist = plane.x * v.x + plane.y * v.y + plane.z * v.z + plane.w * v.w;
+
+        if ((prevDist >= 0.0f) != (curDist >= 0.0f)) {
+            out[outCount++] = lerpClipVertex(prev, cur, prevDist / (prevDist - curDist));
+        }
+        if (curDist >= 0.0f) {
+            out[outCount++] = cur;
         }
+
+        prev = cur;
+        prevDist = curDist;
     }
 
-    for (int i = 0; i < kv_size(renderState.trianglesToRaster); i++) {
-        Triangle3d tri = kv_A(renderState.trianglesToRaster, i);
+    return outCount;
+}
 
-        Triangle3d clipped[2];
-        kdq_push(Triangle3d, renderState.trinaglesDeque, tri);
-        int newTriangles = 1;
+// Clips a clip-space triangle against the near plane and the guard band
+// planes in `outcodes`, then fans the remaining polygon out to the rasterizer.
+// Smooth shaded when `smooth`, with the vertex shades, flat with `color` otherwise.
+static void clipAndQueueTriangle(const ClipVertex *tri, int outcodes, bool smooth, SDL_Color color) {
+    float band = renderState.guardBand;
+    const Vector4 planes[5] = {
+        { 0.0f, 0.0f, 1.0f, 0.0f },     // CLIP_NEAR: z >= 0
+        { 1.0f, 0.0f, 0.0f, band },     // CLIP_LEFT: x >= -band * w
+        { -1.0f, 0.0f, 0.0f, band },    // CLIP_RIGHT: x <= band * w
+        { 0.0f, 1.0f, 0.0f, band },     // CLIP_BOTTOM: y >= -band * w
+        { 0.0f, -1.0f, 0.0f, band },    // CLIP_TOP: y <= band * w
+    };
 
-        for (int p = 0; p < 4; p++) {
-            int trisToAdd = 0;
-            while (newTriangles > 0) {
-                Triangle3d test = kdq_A(renderState.trinaglesDeque, 0);
-                kdq_unshift(renderState.trinaglesDeque);
-                newTriangles--;
+    ClipVertex buffers[2][MAX_CLIP_POLYGON + 1];
+    ClipVertex *polygon = buffers[0];
+    int count = 3;
+    polygon[0] = tri[0];
+    polygon[1] = tri[1];
+    polygon[2] = tri[2];
+
+    for (int p = 0; p < 5 && count >= 3; p++) {
+        if (outcodes & (1 << p)) {
+            ClipVertex *out = polygon == buffers[0] ? buffers[1] : buffers[0];
+            count = clipPolygonAgainstPlane(polygon, count, out, planes[p]);
+            polygon = out;
+        }
+    }
+    if (count < 3) {
+        return;
+    }
 
-                switch (p)
-                {
-                case 0:	trisToAdd = Triangle_ClipAgainstPlane(
-                    (Vector4){ 0.0f, 0.0f, 0.0f },
-                    (Vector4){ 0.0f, 1.0f, 0.0f }, &test, &clipped[0], &clipped[1]);
-                    break;
-                case 1:	trisToAdd = Triangle_ClipAgainstPlane(
-                    (Vector4){ 0.0f, (float)SCREEN_HEIGHT - 1, 0.0f },
-                    (Vector4){ 0.0f, -1.0f, 0.0f }, &test, &clipped[0], &clipped[1]);
-                    break;
-                case 2:	trisToAdd = Triangle_ClipAgainstPlane(
-                    (Vector4){ 0.0f, 0.0f, 0.0f },
-                    (Vector4){ 1.0f, 0.0f, 0.0f }, &test, &clipped[0], &clipped[1]);
-                    break;
-                case 3:	trisToAdd = Triangle_ClipAgainstPlane(
-                    (Vector4){ (float)SCREEN_WIDTH, 0.0f, 0.0f },
-                    (Vector4){ -1.0f, 0.0f, 0.0f }, &test, &clipped[0], &clipped[1]);
-                    break;
-                }
-                for (int w = 0; w < trisToAdd; w++)
-                    kdq_push(Triangle3d, renderState.trinaglesDeque, clipped[w]);
+    Vector4 points[MAX_CLIP_POLYGON + 1];
+    for (int i = 0; i < count; i++) {
+        points[i] = polygon[i].projected ? polygon[i].screen : projectClipVertex(polygon[i].position);
+    }
+    for (int i = 2; i < count; i++) {
+        float shades[3] = { polygon[0].shade, polygon[i - 1].shade, polygon[i].shade };
+        queueRasterTriangle(points[0], points[i - 1], points[i], smooth ? shades : NULL, color);
+    }
+    if (renderState.wireframe) {
+        queueWireEdges(points, count);
+    }
+}
+
+// Tests the model's bounding sphere, then its box, against the frustum.
+// Models inside every plane but the far one need no clipping.
+//
+// The planes are brought into model space instead of the bounds into world
+// space: an affine transform keeps every point on the same side of a plane,
+// so both tests stay exact under rotation and scale.
+static int cullModel(const Mesh3d *mesh, const Matrix4 *world) {
+    Vector3 center = mesh->boundsCenter;
+    Vector3 boxMin = mesh->boundsMin;
+    Vector3 boxMax = mesh->boundsMax;
+    float radius = mesh->boundsRadius;
+    int visibility = CULL_INSIDE;
+
+    for (int i = 0; i < FRUSTUM_PLANES; i++) {
+        Vector4 p = renderState.frustum[i];
+        Vector4 plane = {
+            world->m[0][0] * p.x + world->m[0][1] * p.y + world->m[0][2] * p.z,
+            world->m[1][0] * p.x + world->m[1][1] * p.y + world->m[1][2] * p.z,
+            world->m[2][0] * p.x + world->m[2][1] * p.y + world->m[2][2] * p.z,
+            world->m[3][0] * p.x + world->m[3][1] * p.y + world->m[3][2] * p.z + p.w,
+        };
+
+        // Distances in model units for the sphere, which needs a unit normal
+        float length = sqrtf(plane.x * plane.x + plane.y * plane.y + plane.z * plane.z);
+        float distance = plane.x * center.x + plane.y * center.y + plane.z * center.z + plane.w;
+        if (distance < -radius * length) {
+            return CULL_OUTSIDE;
+        }
+        if (distance >= radius * length || i == FRUSTUM_FAR) {
+            continue;
+        }
+
+        // The box corners farthest along and against the plane's normal
+        Vector3 inner = {
+            plane.x >= 0.0f ? boxMax.x : boxMin.x,
+            plane.y >= 0.0f ? boxMax.y : boxMin.y,
+            plane.z >= 0.0f ? boxMax.z : boxMin.z,
+        };
+        Vector3 outer = {
+            plane.x >= 0.0f ? boxMin.x : boxMax.x,
+            plane.y >= 0.0f ? boxMin.y : boxMax.y,
+            plane.z >= 0.0f ? boxMin.z : boxMax.z,
+        };
+        if (plane.x * inner.x + plane.y * inner.y + plane.z * inner.z + plane.w < 0.0f) {
+            return CULL_OUTSIDE;
+        }
+        if (plane.x * outer.x + plane.y * outer.y + plane.z * outer.z + plane.w < 0.0f) {
+            visibility = CULL_INTERSECTS;
+        }
+    }
+
+    return visibility;
+}
+
+// Largest factor by which `world` scales a length
+static float worldScale(const Matrix4 *world) {
+    float scaleSq = 0.0f;
+    for (int i = 0; i < 3; i++) {
+        float rowSq = world->m[i][0] * world->m[i][0] + world->m[i][1] * world->m[i][1] + world->m[i][2] * world->m[i][2];
+        scaleSq = MAX(scaleSq, rowSq);
+    }
+    return sqrtf(scaleSq);
+}
+
+// Transforms, culls and lights the model and queues its triangles
+static void queueModel(Mesh3d *mesh, const Matrix4 *world, int visibility) {
+    Matrix4 matWorldViewProj = Matrix_MultiplyMatrix((Matrix4*)world, &renderState.viewProjMatrix);
+
+    reserveVertexScratch(mesh->vertexCount);
+    float **clip = renderState.clipVertices;
+    float **screen = renderState.screenVertices;
+
+    // Culling and lighting happen in model space against the stored face
+    // normals, with the camera and light brought into it once per draw
+    Matrix4 inverse = Matrix_InverseAffine(world);
+    Vector3 eye = renderState.camera.position;
+    Vector3 camera = {
+        eye.x * inverse.m[0][0] + eye.y * inverse.m[1][0] + eye.z * inverse.m[2][0] + inverse.m[3][0],
+        eye.x * inverse.m[0][1] + eye.y * inverse.m[1][1] + eye.z * inverse.m[2][1] + inverse.m[3][1],
+        eye.x * inverse.m[0][2] + eye.y * inverse.m[1][2] + eye.z * inverse.m[2][2] + inverse.m[3][2],
+    };
+
+    // Normals go to world space through the inverse transpose, so the light
+    // comes to model space through the inverse. Rescaled by the world scale
+    // so that lighting is exact for rotations and uniform scales.
+    Vector3 l = renderState.light;
+    float scale = worldScale(world);
+    Vector3 light = {
+        (l.x * inverse.m[0][0] + l.y * inverse.m[1][0] + l.z * inverse.m[2][0]) * scale,
+        (l.x * inverse.m[0][1] + l.y * inverse.m[1][1] + l.z * inverse.m[2][1]) * scale,
+        (l.x * inverse.m[0][2] + l.y * inverse.m[1][2] + l.z * inverse.m[2][2]) * scale,
+    };
+
+    // Smooth shading lights every vertex once, faces interpolate between them
+    bool smooth = renderState.shadingMode == SHADING_SMOOTH && mesh->vertexNormals != NULL;
+    float *shades = renderState.vertexShades;
+    bool shaded = renderState.shadedMesh == mesh && renderState.shadedLight.x == light.x
+        && renderState.shadedLight.y == light.y && renderState.shadedLight.z == light.z;
+    if (smooth && !shaded) {
+        renderState.shadedMesh = mesh;
+        renderState.shadedLight = light;
+        for (int i = 0; i < mesh->vertexCount; i++) {
+            Vector3 n = mesh->vertexNormals[i];
+            shades[i] = MAX(0.1f, n.x * light.x + n.y * light.y + n.z * light.z) * 255.0f;
+        }
+    }
+
+    // Straight to screen space through the combined world/view/projection matrix
+    Matrix_ProjectPoints(&matWorldViewProj, mesh->vertices, mesh->vertexCount,
+        clip, screen, 0.5f * (float)platform.renderWidth, 0.5f * (float)platform.renderHeight);
+
+    unsigned short *codes = renderState.clipCodes;
+    if (visibility == CULL_INSIDE) {
+        memset(codes, 0, sizeof(unsigned short) * mesh->vertexCount);
+    } else {
+        for (int i = 0; i < mesh->vertexCount; i++) {
+            codes[i] = clipOutcode(clip[0][i], clip[1][i], clip[2][i], clip[3][i], 1.0f)
+                     | clipOutcode(clip[0][i], clip[1][i], clip[2][i], clip[3][i], renderState.guardBand) << CLIP_GUARD_SHIFT;
+        }
+    }
+
+    for (int i = 0; i < mesh->triangleCount; i++) {
+        int *face = &mesh->indices[i * 3];
+        int a = face[0], b = face[1], c = face[2];
+
+        // Back facing when the camera is not in front of the face's plane
+        Vector4 plane = mesh->faceNormals[i];
+        if (plane.x * camera.x + plane.y * camera.y + plane.z * camera.z + plane.w <= 0.0f) {
+            continue;
+        }
+
+        SDL_Color color = {0};
+        if (!smooth) {
+            float lightIntensity = MAX(0.1f, plane.x * light.x + plane.y * light.y + plane.z * light.z);
+            color = (SDL_Color){lightIntensity * 255, lightIntensity * 255, lightIntensity * 255};
+        }
+
+        // Completely outside one of the screen edges or behind the near plane
+        if (codes[a] & codes[b] & codes[c] & CLIP_SCREEN_MASK) {
+            continue;
+        }
+
+        int guardCodes = (codes[a] | codes[b] | codes[c]) >> CLIP_GUARD_SHIFT;
+        if (guardCodes == 0) {
+            // Inside the guard band: already projected by the batch
+            float faceShades[3] = { shades[a], shades[b], shades[c] };
+            Vector4 points[3] = {
+                { screen[0][a], screen[1][a], screen[2][a], clip[3][a] },
+                { screen[0][b], screen[1][b], screen[2][b], clip[3][b] },
+                { screen[0][c], screen[1][c], screen[2][c], clip[3][c] },
+            };
+            queueRasterTriangle(points[0], points[1], points[2], smooth ? faceShades : NULL, color);
+            if (renderState.wireframe) {
+                queueWireEdges(points, 3);
             }
-            newTriangles = kdq_size(renderState.trinaglesDeque);
+            continue;
+        }
+
+        ClipVertex triClip[3];
+        for (int k = 0; k < 3; k++) {
+            int v = face[k];
+            triClip[k] = (ClipVertex){
+                { clip[0][v], clip[1][v], clip[2][v], clip[3][v] },
+                smooth ? shades[v] : 0.0f,
+                true,
+                { screen[0][v], screen[1][v], screen[2][v], clip[3][v] },
+            };
+        }
+        clipAndQueueTriangle(triClip, guardCodes, smooth, color);
+    }
+}
+
+static int compareDrawCommands(const void *a, const void *b) {
+    const DrawCommand *ca = (const DrawCommand*)a;
+    const DrawCommand *cb = (const DrawCommand*)b;
+
+    if (ca->depth != cb->depth) {
+        return ca->depth < cb->depth ? -1 : 1;
+    }
+    return ca->order - cb->order;
+}
+
+// Instances of one mesh by level of detail, then nearest first. Finer levels
+// are the nearer ones, so the order stays close to front to back.
+static int compareInstances(const void *a, const void *b) {
+    const DrawCommand *ca = (const DrawCommand*)a;
+    const DrawCommand *cb = (const DrawCommand*)b;
+
+    if (ca->level != cb->level) {
+        return ca->level - cb->level;
+    }
+    return compareDrawCommands(a, b);
+}
+
+// Draws the recorded commands nearest first, so that the depth buffer
+// rejects as much of the farther models as possible
+static void flushDrawCommands() {
+    size_t count = kv_size(renderState.drawCommands);
+    if (count == 0) {
+        return;
+    }
+
+    qsort(renderState.drawCommands.a, count, sizeof(DrawCommand), compareDrawCommands);
+
+    ensureDepthCleared();
+    renderState.shadedMesh = NULL;
+    for (size_t i = 0; i < count; i++) {
+        DrawCommand *command = &kv_A(renderState.drawCommands, i);
+        queueModel(command->mesh, &command->world, command->visibility);
+    }
+    flushRasterTriangles();
+
+    kv_empty(renderState.drawCommands);
+}
+
+void SetDeferredDrawing(bool enabled) {
+    flushDrawCommands();
+    renderState.deferred = enabled;
+}
+
+void SetLodErrorBudget(float pixels) {
+    renderState.lodErrorBudget = MAX(pixels, 0.0f);
+}
+
+// The coarsest level whose error, seen from the nearest point of the
+// model's bounds, stays within the budget. `scale` is the world scale.
+static Mesh3d *selectLod(Mesh3d *mesh, float depth, float scale) {
+    float distance = depth - mesh->boundsRadius * scale;
+    if (mesh->lodCount == 0 || renderState.lodErrorBudget <= 0.0f || distance <= 0.0f) {
+        return mesh;
+    }
+
+    float pixelsPerUnit = renderState.projMatrix.m[1][1] * 0.5f * (float)platform.renderHeight * scale / distance;
+    Mesh3d *level = mesh;
+    for (int i = 0; i < mesh->lodCount; i++) {
+        if (mesh->lods[i].lodError * pixelsPerUnit > renderState.lodErrorBudget) {
+            break;
         }
+        level = &mesh->lods[i];
+    }
+    return level;
+}
 
-        for (int i = 0 ; i < kdq_size(renderState.trinaglesDeque); i++) {
-            Triangle3d tri = kdq_A(renderState.trinaglesDeque, i);
-            FillTriangle(
-                (int)tri.points[0].x, (int)tri.points[0].y, tri.points[0].z,
-                (int)tri.points[1].x, (int)tri.points[1].y, tri.points[1].z,
-                (int)tri.points[2].x, (int)tri.points[2].y, tri.points[2].z,
-                tri.color
-            );
-            // if (wireframe) {
-                // DrawTriangle(tri, COLOR_GREEN);
-            // }
+// Culls one instance and picks its level of detail. Returns false when it
+// is not visible, otherwise fills everything in `command` but the order.
+static bool prepareDrawCommand(Mesh3d *mesh, const Matrix4 *world, DrawCommand *command) {
+    int visibility = cullModel(mesh, world);
+    if (visibility == CULL_OUTSIDE) {
+        return false;
+    }
+
+    const Matrix4 *view = &renderState.viewMatrix;
+    Vector3 c = mesh->boundsCenter;
+    Vector3 center = {
+        c.x * world->m[0][0] + c.y * world->m[1][0] + c.z * world->m[2][0] + world->m[3][0],
+        c.x * world->m[0][1] + c.y * world->m[1][1] + c.z * world->m[2][1] + world->m[3][1],
+        c.x * world->m[0][2] + c.y * world->m[1][2] + c.z * world->m[2][2] + world->m[3][2],
+    };
+    float depth = center.x * view->m[0][2] + center.y * view->m[1][2] + center.z * view->m[2][2] + view->m[3][2];
+
+    command->mesh = selectLod(mesh, depth, worldScale(world));
+    command->level = command->mesh == mesh ? 0 : (int)(command->mesh - mesh->lods) + 1;
+    command->world = *world;
+    command->depth = depth;
+    command->visibility = visibility;
+    return true;
+}
+
+void DrawModel(Mesh3d *mesh, Vector3 position) {
+    DrawModelEx(mesh, Matrix_MakeTranslation(position.x, position.y, position.z));
+}
+
+void DrawModelEx(Mesh3d *mesh, Matrix4 transform) {
+    DrawModelInstanced(mesh, &transform, 1);
+}
+
+void DrawModelInstanced(Mesh3d *mesh, const Matrix4 *transforms, int count) {
+    bool record = renderState.deferred && renderState.mode3d;
+    size_t first = kv_size(renderState.drawCommands);
+
+    for (int i = 0; i < count; i++) {
+        DrawCommand command;
+        if (prepareDrawCommand(mesh, &transforms[i], &command)) {
+            command.order = (int)kv_size(renderState.drawCommands);
+            kv_push(DrawCommand, renderState.drawCommands, command);
         }
-        kdq_empty(renderState.trinaglesDeque);
     }
+    if (record) {
+        return;
+    }
+
+    // Drawn right away as one batch, a level at a time and nearest first
+    // within it. Instances of a level follow each other, so its vertices
+    // stay in the cache and smooth shading lights them once for all the
+    // instances that only move.
+    size_t visible = kv_size(renderState.drawCommands) - first;
+    DrawCommand *commands = renderState.drawCommands.a + first;
+    qsort(commands, visible, sizeof(DrawCommand), compareInstances);
+
+    ensureDepthCleared();
+    renderState.shadedMesh = NULL;
+    for (size_t i = 0; i < visible; i++) {
+        queueModel(commands[i].mesh, &commands[i].world, commands[i].visibility);
+    }
+    flushRasterTriangles();
+
+    renderState.drawCommands.n = first;
 }
 
 Triangle3d InitTriangle3d() {
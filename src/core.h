@@ -11,13 +11,23 @@
 #include "buttonmap.h"
 #include "colors.h"
 #include "vector.h"
+#include "matrix.h"
 
 #define MIN_FLOAT -340282346638528859811704183484516925440.0f
 #define MAX_FLOAT 340282346638528859811704183484516925440.0f
 
 #define SCREEN_WIDTH 640
 #define SCREEN_HEIGHT 480
+// 32 (XRGB8888) or 16 (RGB565), chosen at build time
+#ifndef BITS_PER_PIXEL
 #define BITS_PER_PIXEL 32
+#endif
+
+#if BITS_PER_PIXEL == 16
+typedef Uint16 Pixel;
+#else
+typedef Uint32 Pixel;
+#endif
 
 #define MAX_KEYBOARD_KEYS 512
 
@@ -35,15 +45,121 @@ typedef struct Triangle3d {
     SDL_Color color;
 } Triangle3d;
 
+// Indexed mesh: every triangle is three entries of `indices`
+// pointing into the shared `vertices` array
 typedef struct Mesh3d {
-    Triangle3d *polygons;
-    int polygonCount;
+    Vector4 *vertices;
+    int vertexCount;
+    int *indices;
+    int triangleCount;
+
+    // Unit normal of every face in xyz and, in w, the plane distance
+    // so that dot(normal, p) + w is zero on the face
+    Vector4 *faceNormals;
+    // Unit normal of every vertex, averaged over the faces sharing it
+    Vector3 *vertexNormals;
+
+    // Model space bounds, see UpdateMeshBounds
+    Vector3 boundsMin, boundsMax;
+    Vector3 boundsCenter;
+    float boundsRadius;
+
+    // Simplified levels of detail, coarsest last, see GenerateMeshLods
+    struct Mesh3d *lods;
+    int lodCount;
+    float lodError;     // how far this level strays from the original, in model units
+
+    bool mapped;        // arrays point into an Archive, see LoadMeshFromArchive
 } Mesh3d;
 
+// Texels are stored in the screen format with both sizes padded to a power
+// of two. Tiled textures keep each TEXTURE_TILE x TEXTURE_TILE block of
+// texels together in memory, which suits rotated and perspective sampling.
+#define TEXTURE_TILE_SHIFT 2
+#define TEXTURE_TILE (1 << TEXTURE_TILE_SHIFT)
+
+typedef struct Texture {
+    Pixel *pixels;
+    int width, height;              // size of the source image
+    int widthShift, heightShift;    // stored size is 1 << shift
+    bool tiled;
+} Texture;
+
+// Fonts keep the printable ASCII glyphs of a TTF font, rasterized once into
+// an atlas of ink coverage and tinted as they are drawn. Other characters
+// draw as FONT_MISSING_GLYPH.
+#define FONT_FIRST_GLYPH 32
+#define FONT_GLYPH_COUNT 95
+#define FONT_MISSING_GLYPH '?'
+#define FONT_ATLAS_WIDTH 256
+
+typedef struct Glyph {
+    short x, y;                 // in the atlas
+    short width, height;
+    short offsetX, offsetY;     // from the pen position, at the top of the line
+    short advance;
+} Glyph;
+
+typedef struct Font {
+    Uint8 *atlas;               // nonzero where inked, FONT_ATLAS_WIDTH wide
+    int atlasHeight;
+    int lineSkip;
+    Glyph glyphs[FONT_GLYPH_COUNT];
+    // Added to the advance between each pair of glyphs
+    Sint8 kerning[FONT_GLYPH_COUNT][FONT_GLYPH_COUNT];
+    bool mapped;                // atlas points into an Archive
+} Font;
+
+// Sprite atlases pack images side by side in the screen format. Pixels that
+// are transparent, by colorkey or by alpha, are stored as `colorkey`.
+#define SPRITE_FLIP_X 1
+#define SPRITE_FLIP_Y 2
+
+typedef struct SpriteAtlas {
+    Pixel *pixels;
+    int width, height;
+    bool keyed;                 // has transparent pixels
+    Pixel colorkey;
+} SpriteAtlas;
+
+typedef struct Sprite {
+    const SpriteAtlas *atlas;
+    SDL_Rect source;            // in the atlas
+    int x, y;                   // top left on the screen
+    int flip;                   // SPRITE_FLIP_* flags
+} Sprite;
+
+// Assets converted ahead of time by the packer (`make pack`, see archive.h)
+// and mapped into memory as one file
+typedef struct Archive {
+    Uint8 *data;
+    size_t size;
+    const struct ArchiveEntry *entries;
+    int entryCount;
+} Archive;
+
+// Depth buffer formats. Larger stored values are nearer in all of them.
+// DEPTH_FORMAT_FIXED16 quantizes -z / w, which is affine in 1/w, to 16 bits;
+// DEPTH_FORMAT_INT24 does the same with 24 bits in a 32-bit word. Both store
+// 0 for cleared pixels.
+#define DEPTH_FORMAT_FLOAT32 0
+#define DEPTH_FORMAT_FIXED16 1
+#define DEPTH_FORMAT_INT24 2
+
+// The surface everything is drawn to, locked for direct access to its pixels.
+// At full render size and with the video surface in the screen's pixel format
+// this is the video surface itself and EndDrawing presents it without a copy.
 SDL_Surface* Platform_GetScreenSurface();
-float *Platform_GetDepthBuffer();
+// Pixel format of the screen surface, without locking it or flushing drawing
+SDL_PixelFormat* Platform_GetScreenFormat();
+// Float, Uint16 or Uint32 values depending on Platform_GetDepthFormat, in
+// GetRenderHeight rows of GetRenderWidth
+void *Platform_GetDepthBuffer();
+int Platform_GetDepthFormat();
 
 int InitWindow();
+// InitWindow with a DEPTH_FORMAT_* depth buffer, InitWindow uses DEPTH_FORMAT_FLOAT32
+int InitWindowEx(int depthFormat);
 int CloseWindow();
 bool WindowShouldClose();
 
@@ -53,21 +169,70 @@ bool IsKeyPressed(int key);
 int BeginDrawing();
 int EndDrawing();
 
+// Fill the screen with a color or the background image and reset depth in the
+// same pass. Call right after BeginDrawing, before anything else is drawn.
+void ClearBackground(SDL_Color color);
+void ClearBackgroundImage();
+// Keeps a copy of `image` in the screen format for ClearBackgroundImage, which
+// clears to black without one. Call it again after changing the image, NULL
+// drops the copy. Returns false, with no image kept, when conversion fails.
+bool SetBackgroundImage(SDL_Surface *image);
+// Clear depth only every `frames` frames (1 to 8). The frames in between
+// draw into a depth range in front of the previous frame's instead.
+void SetDepthClearInterval(int frames);
+
+// Dirty rectangle tracking (off by default). The video surface becomes single
+// buffered and keeps its contents, so a frame only needs to redraw what
+// changed, and EndDrawing only presents the areas drawn to. Full size frames
+// only: scaled ones, clears and drawing through Platform_GetScreenSurface
+// present everything. Switching it replaces the video surface, so redraw
+// everything afterwards.
+void SetDirtyTracking(bool enabled);
+
+// Dynamic resolution. Frames are drawn at `scale` times the screen size
+// (0.5 to 1, 1 by default) and EndDrawing scales them up to the screen.
+// Changes take effect at the next BeginDrawing. Rectangles, images, sprites,
+// text and DrawLine are placed in screen pixels and shrink with the frame, so
+// they keep their place and size on the screen. Everything else, and the
+// surface and depth buffer, is in render pixels, GetRenderWidth x
+// GetRenderHeight of them.
+void SetRenderScale(float scale);
+int GetRenderWidth();
+int GetRenderHeight();
+// Adjusts the render scale to hold `seconds` per frame (0, the default,
+// turns it off). UpdateRenderScale takes the measured time of every frame.
+void SetTargetFrameTime(float seconds);
+void UpdateRenderScale(float frameTime);
+
 void DrawRectangle(SDL_Rect*, SDL_Color);
 void DrawLine(int startPosX, int startPosY, int endPosX, int endPosY, SDL_Color color);
+// Draws `count` lines, from points[2 * i] to points[2 * i + 1]. x/y are screen
+// coordinates and z is the depth, as for FillTriangleV. With `depthTest` the
+// lines are hidden behind nearer pixels and write their depth, and they win
+// ties with the surfaces they lie on.
+void DrawLines(const Vector4 *points, int count, SDL_Color color, bool depthTest);
 void DrawTriangle(Triangle3d triangle, SDL_Color color);
 
 void DrawImage(SDL_Surface*);
-void DrawTextEx(TTF_Font*, const char*, Vector2, SDL_Color);
+// Sprites are copied as they are, clipped to the screen
+void DrawSprite(const SpriteAtlas *atlas, SDL_Rect source, int x, int y, int flip);
+// Draws the sprites grouped by atlas. Overlapping sprites of the same atlas
+// keep their order, those of different atlases are drawn one atlas at a time.
+void DrawSprites(const Sprite *sprites, int count);
+// Draws straight from the font's atlas. '\n' starts a new line.
+void DrawTextEx(const Font *font, const char *text, Vector2 position, SDL_Color color);
 
 void DrawPixel(int x, int y, SDL_Color color);
-void PutPixel(int x, int y, Uint32 pixel);
+void PutPixel(int x, int y, Pixel pixel);
 
+// Perspective-correct textured triangle, depth tested. u and v are texture
+// coordinates (0 to 1 covers the image, repeating at the stored size) and w is
+// the vertex's clip space w; depth is derived from it with the 3D projection.
 void DrawTexturedTriangle(
     int x1, int y1, float u1, float v1, float w1,
     int x2, int y2, float u2, float v2, float w2,
     int x3, int y3, float u3, float v3, float w3,
-    SDL_Surface *tex
+    const Texture *tex
 );
 
 void FillTriangle(
@@ -76,6 +241,9 @@ void FillTriangle(
     int x3, int y3, float w3,
     SDL_Color color
 );
+// Sub-pixel precise variant: x/y are screen coordinates and z is the depth.
+// Triangles of any size are clipped to the guard band before they are drawn.
+void FillTriangleV(Vector4 p1, Vector4 p2, Vector4 p3, SDL_Color color);
 
 Triangle3d InitTriangle3d();
 
@@ -87,8 +255,84 @@ void CameraYaw(Camera3d *camera, float angle);
 void BeginMode3d(Camera3d *camera);
 void EndMode3d();
 
+#define SHADING_FLAT 0
+#define SHADING_SMOOTH 1
+
 void SetupLight(Vector3 light);
+// SHADING_FLAT (the default) lights each face once, SHADING_SMOOTH lights
+// the vertices and interpolates between them across the faces
+void SetShadingMode(int mode);
+// Ordered dithering of flat and smooth shaded triangles (off by default),
+// which hides the banding of 16-bit screens. No effect at 32 bits per pixel.
+void SetDithering(bool enabled);
+// Outlines the edges of every drawn face in `color`, over the filled faces
+// and depth tested (off by default)
+void SetWireframe(bool enabled, SDL_Color color);
+// Triangles get clipped against the screen edges only once they reach past
+// `scale` times the screen size (1 to 3, 2 by default)
+void SetGuardBand(float scale);
 void DrawModel(Mesh3d *mesh, Vector3 position);
+// DrawModel with any combination of rotation, scale and translation
+void DrawModelEx(Mesh3d *mesh, Matrix4 transform);
+// Draws `count` instances of the mesh. Culling, level of detail selection
+// and ordering are per instance, the mesh's setup is shared between them.
+void DrawModelInstanced(Mesh3d *mesh, const Matrix4 *transforms, int count);
+// Models switch to a coarser level of detail while its error projects to
+// at most this many pixels (1 by default, 0 always draws full detail)
+void SetLodErrorBudget(float pixels);
+// Deferred drawing (on by default): DrawModel calls between BeginMode3d and
+// EndMode3d are recorded and drawn front to back by EndMode3d, or before
+// anything else is drawn, so that drawing keeps the order of the calls
+void SetDeferredDrawing(bool enabled);
+
+// Overwrites all of `res`, unload a mesh before loading into it again
+bool LoadFromObjectFile(Mesh3d *res, const char *filename);
+void UnloadMesh(Mesh3d *mesh);
+// Recomputes the bounding box and sphere. LoadFromObjectFile does this,
+// meshes built or modified by hand need it before they are drawn.
+void UpdateMeshBounds(Mesh3d *mesh);
+// Recomputes the face normals, for meshes built or modified by hand. The
+// normal arrays are reallocated, so they must be NULL or allocated by an
+// earlier call.
+void UpdateMeshNormals(Mesh3d *mesh);
+// Builds the mesh's levels of detail by edge collapse, each with at most
+// half the triangles of the one before, replacing any built before.
+// LoadFromObjectFile does this.
+void GenerateMeshLods(Mesh3d *mesh);
+
+// Converts `image` to the screen format once, at load time
+bool CreateTexture(Texture *res, SDL_Surface *image, bool tiled);
+bool LoadTexture(Texture *res, const char *filename, bool tiled);
+void UnloadTexture(Texture *texture);
+// Index into `pixels` of texel (u, v), both within the stored size
+int TextureOffset(const Texture *texture, int u, int v);
+
+// Rasterizes the font's glyphs, `ttf` is not needed afterwards
+bool CreateFont(Font *res, TTF_Font *ttf);
+bool LoadFont(Font *res, const char *filename, int size);
+void UnloadFont(Font *font);
+
+// Packs the images into one atlas and stores where each of them went in
+// `rects`. LoadSpriteAtlas uses a single image, a sprite sheet, as it is.
+bool CreateSpriteAtlas(SpriteAtlas *res, SDL_Surface **images, int count, SDL_Rect *rects);
+bool LoadSpriteAtlas(SpriteAtlas *res, const char *filename);
+void UnloadSpriteAtlas(SpriteAtlas *atlas);
+
+// Maps the archive. Loading from an archive that failed to load, or that lacks
+// an asset or holds a damaged one, loads the asset's own file instead.
+bool LoadArchive(Archive *res, const char *filename);
+// Assets loaded from the archive must be unloaded first
+void UnloadArchive(Archive *archive);
+// Blob of the entry and its size in bytes, NULL when there is no such entry
+// of `type`. Offsets inside the blob are unchecked.
+const void *FindArchiveEntry(const Archive *archive, const char *name, int type, Uint32 *size);
+// The asset at `filename` without reading or converting it when it was
+// packed. The pixels, samples and glyphs stay in the archive, mesh arrays too,
+// which makes those read only. Unload them as usual.
+SDL_Surface *LoadImageFromArchive(const Archive *archive, const char *filename);
+Mix_Chunk *LoadSoundFromArchive(const Archive *archive, const char *filename);
+bool LoadMeshFromArchive(Mesh3d *res, const Archive *archive, const char *filename);
+bool LoadFontFromArchive(Font *res, const Archive *archive, const char *filename, int size);
 
 
 Vector4 Vector_IntersectPlane(Vector4 plane_p, Vector4 plane_n, Vector4 *lineStart, Vector4 *lineEnd);
@@ -0,0 +1,143 @@
+#include "stdlib.h"
+#include "string.h"
+
+#include "core.h"
+
+// Ink coverage of a glyph surface as SDL_ttf renders it: 8 bits per pixel,
+// with index 0 for the background. The glyph starts `top` rows down.
+static void copyGlyph(Font *font, const Glyph *glyph, SDL_Surface *surface, int top)
+{
+    SDL_LockSurface(surface);
+    for (int y = 0; y < glyph->height; y++) {
+        const Uint8 *src = (const Uint8*)surface->pixels + (top + y) * surface->pitch;
+        Uint8 *dst = font->atlas + (glyph->y + y) * FONT_ATLAS_WIDTH + glyph->x;
+        for (int x = 0; x < glyph->width; x++) {
+            dst[x] = src[x] != 0;
+        }
+    }
+    SDL_UnlockSurface(surface);
+}
+
+// SDL_ttf only applies kerning within its own layout, so it is recovered
+// from the laid out width of each pair. `extents` are where each glyph
+// ends, the larger of its advance and its ink.
+static void measureKerning(Font *font, TTF_Font *ttf, const int *extents)
+{
+    memset(font->kerning, 0, sizeof(font->kerning));
+    if (!TTF_GetFontKerning(ttf)) {
+        return;
+    }
+
+    for (int a = 0; a < FONT_GLYPH_COUNT; a++) {
+        const Glyph *left = &font->glyphs[a];
+        for (int b = 0; b < FONT_GLYPH_COUNT; b++) {
+            const Glyph *right = &font->glyphs[b];
+            char pair[3] = { (char)(FONT_FIRST_GLYPH + a), (char)(FONT_FIRST_GLYPH + b), 0 };
+            int width;
+            if (TTF_SizeUTF8(ttf, pair, &width, NULL) != 0) {
+                continue;
+            }
+
+            // Assuming the right glyph ends the pair, then checking that it does
+            int kerning = width - left->advance - extents[b] + MIN(0, left->offsetX);
+            int start = MIN(0, MIN(left->offsetX, left->advance + kerning + right->offsetX));
+            int end = MAX(extents[a], left->advance + kerning + extents[b]);
+            if (end - start == width) {
+                font->kerning[a][b] = (Sint8)CLAMP(kerning, -128, 127);
+            }
+        }
+    }
+}
+
+bool CreateFont(Font *res, TTF_Font *ttf)
+{
+    SDL_Surface *surfaces[FONT_GLYPH_COUNT];
+    int tops[FONT_GLYPH_COUNT];
+    int extents[FONT_GLYPH_COUNT];
+    int ascent = TTF_FontAscent(ttf);
+    int lineHeight = TTF_FontHeight(ttf);
+    SDL_Color ink = { 255, 255, 255 };
+
+    // Shelf packing, a row of glyphs as tall as the tallest of them
+    int x = 0, y = 0, shelfHeight = 0;
+    for (int i = 0; i < FONT_GLYPH_COUNT; i++) {
+        Uint16 ch = (Uint16)(FONT_FIRST_GLYPH + i);
+        Glyph *glyph = &res->glyphs[i];
+        int minx = 0, maxx = 0, miny = 0, maxy = 0, advance = 0;
+        TTF_GlyphMetrics(ttf, ch, &minx, &maxx, &miny, &maxy, &advance);
+
+        // SDL_ttf trims bitmaps to the glyph's box and the line's height when
+        // it lays out text
+        surfaces[i] = TTF_RenderGlyph_Solid(ttf, ch, ink);
+        int offsetY = ascent - maxy;
+        tops[i] = MAX(-offsetY, 0);
+        int width = 0, height = 0;
+        if (surfaces[i] != NULL) {
+            width = CLAMP(MIN(surfaces[i]->w, maxx - minx), 0, FONT_ATLAS_WIDTH);
+            height = MAX(MIN(surfaces[i]->h, lineHeight - offsetY) - tops[i], 0);
+        }
+
+        if (x + width > FONT_ATLAS_WIDTH) {
+            x = 0;
+            y += shelfHeight;
+            shelfHeight = 0;
+        }
+        glyph->x = (short)x;
+        glyph->y = (short)y;
+        glyph->width = (short)width;
+        glyph->height = (short)height;
+        glyph->offsetX = (short)minx;
+        glyph->offsetY = (short)(offsetY + tops[i]);
+        glyph->advance = (short)advance;
+        extents[i] = MAX(advance, maxx);
+
+        x += width;
+        shelfHeight = MAX(shelfHeight, height);
+    }
+
+    res->atlasHeight = y + shelfHeight;
+    res->lineSkip = TTF_FontLineSkip(ttf);
+    res->mapped = false;
+    res->atlas = (Uint8*)calloc(FONT_ATLAS_WIDTH * MAX(res->atlasHeight, 1), sizeof(Uint8));
+
+    for (int i = 0; i < FONT_GLYPH_COUNT; i++) {
+        if (surfaces[i] == NULL) {
+            continue;
+        }
+        if (res->atlas != NULL) {
+            copyGlyph(res, &res->glyphs[i], surfaces[i], tops[i]);
+        }
+        SDL_FreeSurface(surfaces[i]);
+    }
+    if (res->atlas == NULL) {
+        return false;
+    }
+
+    measureKerning(res, ttf, extents);
+
+    return true;
+}
+
+bool LoadFont(Font *res, const char *filename, int size)
+{
+    TTF_Font *ttf = TTF_OpenFont(filename, size);
+    if (ttf == NULL)
+    {
+        return false;
+    }
+
+    bool loaded = CreateFont(res, ttf);
+    TTF_CloseFont(ttf);
+
+    return loaded;
+}
+
+void UnloadFont(Font *font)
+{
+    if (!font->mapped) {
+        free(font->atlas);
+    }
+
+    font->atlas = NULL;
+    font->atlasHeight = 0;
+}
@@ -0,0 +1,461 @@
+#include "stdlib.h"
+#include "string.h"
+#include "math.h"
+
+#include "kvec.h"
+
+#include "core.h"
+
+// Every level has at most half the triangles of the one before. Generation
+// stops after MAX_MESH_LODS levels, below MIN_LOD_TRIANGLES triangles, or
+// once simplification stalls.
+#define MAX_MESH_LODS 4
+#define MIN_LOD_TRIANGLES 32
+
+// Symmetric 4x4 error quadric: xx xy xz xw yy yz yw zz zw ww
+typedef struct Quadric {
+    double q[10];
+} Quadric;
+
+typedef struct LodEdge {
+    int remove;     // vertex that goes away
+    int keep;       // vertex it merges into
+    float cost;
+} LodEdge;
+
+// Simplification state. Collapses only ever keep one of the two vertices,
+// so every level is a subset of the original vertices.
+typedef struct LodBuilder {
+    const Vector4 *vertices;
+    int vertexCount;
+    kvec_t(int) indices;        // current triangles, original vertex ids
+    Quadric *quadrics;
+    bool *boundary;
+    int *representative;        // vertex each original vertex was merged into
+} LodBuilder;
+
+static void addQuadric(Quadric *a, const Quadric *b)
+{
+    for (int i = 0; i < 10; i++) {
+        a->q[i] += b->q[i];
+    }
+}
+
+static double quadricError(const Quadric *a, Vector4 v)
+{
+    const double *q = a->q;
+    double x = v.x, y = v.y, z = v.z;
+    return q[0] * x * x + 2.0 * q[1] * x * y + 2.0 * q[2] * x * z + 2.0 * q[3] * x
+         + q[4] * y * y + 2.0 * q[5] * y * z + 2.0 * q[6] * y
+         + q[7] * z * z + 2.0 * q[8] * z
+         + q[9];
+}
+
+static Vector3 faceNormal(Vector4 a, Vector4 b, Vector4 c)
+{
+    Vector3 line1 = { b.x - a.x, b.y - a.y, b.z - a.z };
+    Vector3 line2 = { c.x - a.x, c.y - a.y, c.z - a.z };
+    return Vector3CrossProduct(line1, line2);
+}
+
+static int compareEdgeKeys(const void *a, const void *b)
+{
+    long long va = *(const long long*)a, vb = *(const long long*)b;
+    return va < vb ? -1 : (va > vb ? 1 : 0);
+}
+
+static int compareLodEdges(const void *a, const void *b)
+{
+    float ca = ((const LodEdge*)a)->cost, cb = ((const LodEdge*)b)->cost;
+    return ca < cb ? -1 : (ca > cb ? 1 : 0);
+}
+
+// Plane quadrics of the faces around every vertex, and the vertices on
+// open edges, which are never removed so silhouettes keep their outline
+static void initLodBuilder(LodBuilder *b, const Mesh3d *mesh)
+{
+    b->vertices = mesh->vertices;
+    b->vertexCount = mesh->vertexCount;
+    b->quadrics = (Quadric*)calloc(mesh->vertexCount, sizeof(Quadric));
+    b->boundary = (bool*)calloc(mesh->vertexCount, sizeof(bool));
+    b->representative = (int*)malloc(sizeof(int) * mesh->vertexCount);
+    for (int v = 0; v < mesh->vertexCount; v++) {
+        b->representative[v] = v;
+    }
+
+    kv_init(b->indices);
+    for (int i = 0; i < mesh->triangleCount * 3; i++) {
+        kv_push(int, b->indices, mesh->indices[i]);
+    }
+
+    for (int i = 0; i < mesh->triangleCount; i++) {
+        const int *face = &mesh->indices[i * 3];
+        Vector3 n = faceNormal(b->vertices[face[0]], b->vertices[face[1]], b->vertices[face[2]]);
+        if (Vector3DotProduct(n, n) == 0.0f) {
+            continue;
+        }
+        n = Vector3Normalize(&n);
+        double d = -(n.x * b->vertices[face[0]].x + n.y * b->vertices[face[0]].y + n.z * b->vertices[face[0]].z);
+
+        Quadric plane = { {
+            n.x * n.x, n.x * n.y, n.x * n.z, n.x * d,
+            n.y * n.y, n.y * n.z, n.y * d,
+            n.z * n.z, n.z * d,
+            d * d,
+        } };
+        for (int k = 0; k < 3; k++) {
+            addQuadric(&b->quadrics[face[k]], &plane);
+        }
+    }
+
+    // An edge used by a single face is open. Edges are packed as
+    // (min << 32 | max) and counted after sorting.
+    int edgeCount = mesh->triangleCount * 3;
+    long long *edges = (long long*)malloc(sizeof(long long) * edgeCount);
+    for (int i = 0; i < edgeCount; i++) {
+        int a = mesh->indices[i];
+        int c = mesh->indices[(i % 3 == 2) ? i - 2 : i + 1];
+        edges[i] = ((long long)MIN(a, c) << 32) | MAX(a, c);
+    }
+    qsort(edges, edgeCount, sizeof(long long), compareEdgeKeys);
+    for (int i = 0; i < edgeCount; ) {
+        int j = i + 1;
+        while (j < edgeCount && edges[j] == edges[i]) {
+            j++;
+        }
+        if (j - i == 1) {
+            b->boundary[(int)(edges[i] >> 32)] = true;
+            b->boundary[(int)(edges[i] & 0xFFFFFFFF)] = true;
+        }
+        i = j;
+    }
+    free(edges);
+}
+
+static void freeLodBuilder(LodBuilder *b)
+{
+    kv_destroy(b->indices);
+    free(b->quadrics);
+    free(b->boundary);
+    free(b->representative);
+}
+
+// Would moving `remove` onto `keep` turn any of the faces around it over?
+static bool collapseFlips(const LodBuilder *b, const int *faces, int faceCount, int remove, int keep)
+{
+    const int *indices = b->indices.a;
+
+    for (int i = 0; i < faceCount; i++) {
+        const int *face = &indices[faces[i] * 3];
+        if (face[0] == keep || face[1] == keep || face[2] == keep) {
+            continue;   // collapses away
+        }
+
+        Vector4 before[3], after[3];
+        for (int k = 0; k < 3; k++) {
+            before[k] = b->vertices[face[k]];
+            after[k] = face[k] == remove ? b->vertices[keep] : before[k];
+        }
+        Vector3 n0 = faceNormal(before[0], before[1], before[2]);
+        Vector3 n1 = faceNormal(after[0], after[1], after[2]);
+        if (Vector3DotProduct(n0, n1) <= 0.0f) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// One round of independent edge collapses, cheapest first, stopping once the
+// mesh is down to `targetTriangles`. Returns the number of collapses.
+static int collapsePass(LodBuilder *b, int targetTriangles)
+{
+    int *indices = b->indices.a;
+    int triangleCount = kv_size(b->indices) / 3;
+    int vertexCount = b->vertexCount;
+
+    // Faces around every vertex
+    int *faceStart = (int*)calloc(vertexCount + 1, sizeof(int));
+    int *faceList = (int*)malloc(sizeof(int) * triangleCount * 3);
+    for (int i = 0; i < triangleCount * 3; i++) {
+        faceStart[indices[i] + 1]++;
+    }
+    for (int v = 0; v < vertexCount; v++) {
+        faceStart[v + 1] += faceStart[v];
+    }
+    int *fill = (int*)malloc(sizeof(int) * vertexCount);
+    memcpy(fill, faceStart, sizeof(int) * vertexCount);
+    for (int i = 0; i < triangleCount * 3; i++) {
+        faceList[fill[indices[i]]++] = i / 3;
+    }
+    free(fill);
+
+    // Unique edges and the cheaper allowed direction of each
+    long long *packed = (long long*)malloc(sizeof(long long) * triangleCount * 3);
+    for (int i = 0; i < triangleCount * 3; i++) {
+        int a = indices[i];
+        int c = indices[(i % 3 == 2) ? i - 2 : i + 1];
+        packed[i] = ((long long)MIN(a, c) << 32) | MAX(a, c);
+    }
+    qsort(packed, triangleCount * 3, sizeof(long long), compareEdgeKeys);
+
+    kvec_t(LodEdge) edges;
+    kv_init(edges);
+    for (int i = 0; i < triangleCount * 3; i++) {
+        if (i > 0 && packed[i] == packed[i - 1]) {
+            continue;
+        }
+        int v0 = (int)(packed[i] >> 32), v1 = (int)(packed[i] & 0xFFFFFFFF);
+
+        Quadric sum = b->quadrics[v0];
+        addQuadric(&sum, &b->quadrics[v1]);
+
+        LodEdge edge = { -1, -1, 0.0f };
+        if (!b->boundary[v0]) {
+            edge = (LodEdge){ v0, v1, (float)quadricError(&sum, b->vertices[v1]) };
+        }
+        if (!b->boundary[v1]) {
+            float cost = (float)quadricError(&sum, b->vertices[v0]);
+            if (edge.remove < 0 || cost < edge.cost) {
+                edge = (LodEdge){ v1, v0, cost };
+            }
+        }
+        if (edge.remove >= 0) {
+            kv_push(LodEdge, edges, edge);
+        }
+    }
+    free(packed);
+    qsort(edges.a, kv_size(edges), sizeof(LodEdge), compareLodEdges);
+
+    // Collapses in one pass must not share faces, so each one is checked
+    // against geometry that no other collapse of the pass has moved
+    bool *touched = (bool*)calloc(vertexCount, sizeof(bool));
+    int *remap = (int*)malloc(sizeof(int) * vertexCount);
+    for (int v = 0; v < vertexCount; v++) {
+        remap[v] = v;
+    }
+
+    int collapses = 0;
+    for (size_t i = 0; i < kv_size(edges) && triangleCount > targetTriangles; i++) {
+        LodEdge edge = kv_A(edges, i);
+        if (touched[edge.remove] || touched[edge.keep]) {
+            continue;
+        }
+
+        const int *faces = &faceList[faceStart[edge.remove]];
+        int faceCount = faceStart[edge.remove + 1] - faceStart[edge.remove];
+        if (collapseFlips(b, faces, faceCount, edge.remove, edge.keep)) {
+            continue;
+        }
+
+        for (int k = 0; k < faceCount; k++) {
+            const int *face = &indices[faces[k] * 3];
+            if (face[0] == edge.keep || face[1] == edge.keep || face[2] == edge.keep) {
+                triangleCount--;
+            }
+        }
+        int vertices[2] = { edge.remove, edge.keep };
+        for (int j = 0; j < 2; j++) {
+            for (int k = faceStart[vertices[j]]; k < faceStart[vertices[j] + 1]; k++) {
+                const int *face = &indices[faceList[k] * 3];
+                touched[face[0]] = touched[face[1]] = touched[face[2]] = true;
+            }
+        }
+
+        remap[edge.remove] = edge.keep;
+        addQuadric(&b->quadrics[edge.keep], &b->quadrics[edge.remove]);
+        collapses++;
+    }
+
+    // Rewrite the faces, dropping those that became degenerate
+    size_t out = 0;
+    for (size_t i = 0; i < kv_size(b->indices); i += 3) {
+        int a = remap[indices[i]], c = remap[indices[i + 1]], d = remap[indices[i + 2]];
+        if (a == c || c == d || d == a) {
+            continue;
+        }
+        indices[out++] = a;
+        indices[out++] = c;
+        indices[out++] = d;
+    }
+    b->indices.n = out;
+
+    for (int v = 0; v < vertexCount; v++) {
+        b->representative[v] = remap[b->representative[v]];
+    }
+
+    kv_destroy(edges);
+    free(touched);
+    free(remap);
+    free(faceStart);
+    free(faceList);
+
+    return collapses;
+}
+
+// Squared distance from p to triangle abc (closest point by region,
+// after Ericson's Real-Time Collision Detection)
+static float pointTriangleDistanceSq(Vector3 p, Vector3 a, Vector3 b, Vector3 c)
+{
+    Vector3 ab = Vector3Sub(b, a), ac = Vector3Sub(c, a), ap = Vector3Sub(p, a);
+    float d1 = Vector3DotProduct(ab, ap), d2 = Vector3DotProduct(ac, ap);
+    Vector3 closest;
+
+    Vector3 bp = Vector3Sub(p, b);
+    float d3 = Vector3DotProduct(ab, bp), d4 = Vector3DotProduct(ac, bp);
+    Vector3 cp = Vector3Sub(p, c);
+    float d5 = Vector3DotProduct(ab, cp), d6 = Vector3DotProduct(ac, cp);
+
+    float va = d3 * d6 - d5 * d4;
+    float vb = d5 * d2 - d1 * d6;
+    float vc = d1 * d4 - d3 * d2;
+
+    if (d1 <= 0.0f && d2 <= 0.0f) {
+        closest = a;
+    } else if (d3 >= 0.0f && d4 <= d3) {
+        closest = b;
+    } else if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+        closest = Vector3Add(a, Vector3Mul(ab, d1 / (d1 - d3)));
+    } else if (d6 >= 0.0f && d5 <= d6) {
+        closest = c;
+    } else if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+        closest = Vector3Add(a, Vector3Mul(ac, d2 / (d2 - d6)));
+    } else if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) {
+        closest = Vector3Add(b, Vector3Mul(Vector3Sub(c, b), (d4 - d3) / ((d4 - d3) + (d5 - d6))));
+    } else {
+        float denom = 1.0f / (va + vb + vc);
+        closest = Vector3Add(a, Vector3Add(Vector3Mul(ab, vb * denom), Vector3Mul(ac, vc * denom)));
+    }
+
+    Vector3 d = Vector3Sub(p, closest);
+    return Vector3DotProduct(d, d);
+}
+
+// How far the original vertices lie from the simplified surface: each one is
+// measured against the faces around the vertex it was merged into and the
+// level's error is the largest such distance
+static float measureLodError(const LodBuilder *b)
+{
+    const int *indices = b->indices.a;
+    int faceCount = kv_size(b->indices) / 3;
+
+    int *faceStart = (int*)calloc(b->vertexCount + 1, sizeof(int));
+    int *faceList = (int*)malloc(sizeof(int) * MAX(faceCount * 3, 1));
+    for (int i = 0; i < faceCount * 3; i++) {
+        faceStart[indices[i] + 1]++;
+    }
+    for (int v = 0; v < b->vertexCount; v++) {
+        faceStart[v + 1] += faceStart[v];
+    }
+    int *fill = (int*)malloc(sizeof(int) * b->vertexCount);
+    memcpy(fill, faceStart, sizeof(int) * b->vertexCount);
+    for (int i = 0; i < faceCount * 3; i++) {
+        faceList[fill[indices[i]]++] = i / 3;
+    }
+    free(fill);
+
+    float errorSq = 0.0f;
+    for (int v = 0; v < b->vertexCount; v++) {
+        int r = b->representative[v];
+        if (r == v || faceStart[r] == faceStart[r + 1]) {
+            continue;
+        }
+        Vector3 p = MakeVector3FromVector4(b->vertices[v]);
+        float nearest = MAX_FLOAT;
+        for (int k = faceStart[r]; k < faceStart[r + 1]; k++) {
+            const int *face = &indices[faceList[k] * 3];
+            nearest = MIN(nearest, pointTriangleDistanceSq(p,
+                MakeVector3FromVector4(b->vertices[face[0]]),
+                MakeVector3FromVector4(b->vertices[face[1]]),
+                MakeVector3FromVector4(b->vertices[face[2]])));
+        }
+        errorSq = MAX(errorSq, nearest);
+    }
+
+    free(faceStart);
+    free(faceList);
+
+    return sqrtf(errorSq);
+}
+
+// Copies the current triangles into `level` with their own compact vertices
+static void extractLod(const LodBuilder *b, Mesh3d *level)
+{
+    int *newIndex = (int*)malloc(sizeof(int) * b->vertexCount);
+    for (int v = 0; v < b->vertexCount; v++) {
+        newIndex[v] = -1;
+    }
+
+    memset(level, 0, sizeof(Mesh3d));
+    level->triangleCount = kv_size(b->indices) / 3;
+    level->indices = (int*)malloc(sizeof(int) * kv_size(b->indices));
+    level->vertices = (Vector4*)malloc(sizeof(Vector4) * b->vertexCount);
+
+    for (size_t i = 0; i < kv_size(b->indices); i++) {
+        int v = kv_A(b->indices, i);
+        if (newIndex[v] < 0) {
+            newIndex[v] = level->vertexCount++;
+            level->vertices[newIndex[v]] = b->vertices[v];
+        }
+        level->indices[i] = newIndex[v];
+    }
+    level->vertices = (Vector4*)realloc(level->vertices, sizeof(Vector4) * MAX(level->vertexCount, 1));
+
+    level->lodError = measureLodError(b);
+    UpdateMeshBounds(level);
+    UpdateMeshNormals(level);
+
+    free(newIndex);
+}
+
+void GenerateMeshLods(Mesh3d *mesh)
+{
+    // Replaces any levels built before
+    for (int i = 0; i < mesh->lodCount; i++) {
+        UnloadMesh(&mesh->lods[i]);
+    }
+    free(mesh->lods);
+    mesh->lods = NULL;
+    mesh->lodCount = 0;
+
+    if (mesh->triangleCount < MIN_LOD_TRIANGLES * 2) {
+        return;
+    }
+
+    LodBuilder builder;
+    initLodBuilder(&builder, mesh);
+
+    Mesh3d levels[MAX_MESH_LODS - 1];
+    int levelCount = 0;
+    int triangles = mesh->triangleCount;
+
+    while (levelCount < MAX_MESH_LODS - 1 && triangles / 2 >= MIN_LOD_TRIANGLES) {
+        int target = triangles / 2;
+        while ((int)kv_size(builder.indices) / 3 > target) {
+            if (collapsePass(&builder, target) == 0) {
+                break;
+            }
+        }
+
+        // Not worth a level if simplification got stuck early
+        int reached = kv_size(builder.indices) / 3;
+        if (reached > triangles * 3 / 4) {
+            break;
+        }
+        extractLod(&builder, &levels[levelCount]);
+        // Coarser levels never claim to be more accurate than finer ones
+        if (levelCount > 0) {
+            levels[levelCount].lodError = MAX(levels[levelCount].lodError, levels[levelCount - 1].lodError);
+        }
+        levelCount++;
+        triangles = reached;
+    }
+
+    freeLodBuilder(&builder);
+
+    if (levelCount > 0) {
+        mesh->lods = (Mesh3d*)malloc(sizeof(Mesh3d) * levelCount);
+        memcpy(mesh->lods, levels, sizeof(Mesh3d) * levelCount);
+        mesh->lodCount = levelCount;
+    }
+}
@@ -1,16 +1,15 @@
 #include "stdio.h"
 #include "stdlib.h"
 
-#include "kvec.h"
-#include "deque.h"
-
 #include "matrix.h"
 #include "core.h"
 
-// Font formatting
-const int FONT_SIZE = 24;
+// Font formatting, FONT_SIZE is set by the Makefile so that `make pack`
+// rasterizes the font at the same size
+const int fontSize = FONT_SIZE;
 
-// Resource paths
+// Resource paths, looked up in the archive first
+const char *archivePath = "assets.pak";
 const char *imagePath = "assets/img/battleback8.png";
 const char *fontPath = "assets/font/MMXSNES.ttf";
 const char *bgmPath = "assets/bgm/Mars.wav";
@@ -18,84 +17,20 @@ const char *sfxPath = "assets/sfx/hop.wav";
 
 const int LOOP_MUSIC = 1;
 
-float readFloatFromString(char* str, int *cur) {
-    char buf[128];
-    char c;
-
-    for (int i = 0; i < 128 && c != ' '; i++, (*cur)++) {
-        c = str[*cur];
-        buf[i] = c;
+// Depth of pixel `i` as a float, MIN_FLOAT where nothing was drawn
+static float readDepth(const void *depths, int format, int i) {
+    switch (format) {
+    case DEPTH_FORMAT_FIXED16: {
+        Uint16 code = ((const Uint16*)depths)[i];
+        return code == 0 ? MIN_FLOAT : (float)code;
     }
-
-    return atof(buf);
-}
-
-int readIntFromString(char* str, int *cur) {
-    char buf[128];
-    char c;
-
-    for (int i = 0; i < 128 && c != ' '; i++, (*cur)++) {
-        c = str[*cur];
-        buf[i] = c;
+    case DEPTH_FORMAT_INT24: {
+        Uint32 code = ((const Uint32*)depths)[i];
+        return code == 0 ? MIN_FLOAT : (float)code;
     }
-
-    return atoi(buf);
-}
-
-bool LoadFromObjectFile(Mesh3d *res, char *filename)
-{
-    FILE* fp;
-    char *line = NULL;
-    size_t len = 0;
-    ssize_t read;
-
-    fp = fopen(filename, "r");
-    if (fp == NULL)
-        return false;
-
-    // Local cache of verts
-    kvec_t(Vector4) verts;
-    kv_init(verts);
-
-    kvec_t(Triangle3d) tris;
-    kv_init(tris);
-
-    while ((read = getline(&line, &len, fp)) != -1)
-    {
-        if (line[0] == 'v')
-        {
-            if (line[1] != 't') {
-                Vector4 v = MakeVector4();
-
-                int cur = 2;
-                v.x = readFloatFromString(line, &cur);
-                v.y = readFloatFromString(line, &cur);
-                v.z = readFloatFromString(line, &cur);
-                kv_push(Vector4, verts, v);
-            }
-        }
-
-        if (line[0] == 'f')
-        {
-            int f[3];
-            int cur = 2;
-            f[0] = readIntFromString(line, &cur);
-            f[1] = readIntFromString(line, &cur);
-            f[2] = readIntFromString(line, &cur);
-
-            Triangle3d tri = { kv_A(verts, f[0] - 1), kv_A(verts, f[1] - 1), kv_A(verts, f[2] - 1) };
-            kv_push(Triangle3d, tris, tri);
-        }
+    default:
+        return ((const float*)depths)[i];
     }
-
-    res->polygons = tris.a;
-    res->polygonCount = kv_size(tris);
-
-    kv_destroy(verts);
-    free(line);
-    fclose(fp);
-
-    return true;
 }
 
 int main(int argc, char **argv) {
@@ -104,26 +39,32 @@ int main(int argc, char **argv) {
     float elapseds[3] = { 60, 60, 60 };
     int curElapsed = 0;
 
-    Mix_Chunk *sfx = Mix_LoadWAV(sfxPath);
-    Mix_Chunk *bgm = Mix_LoadWAV(bgmPath);
+    Archive archive;
+    LoadArchive(&archive, archivePath);
+
+    Mix_Chunk *sfx = LoadSoundFromArchive(&archive, sfxPath);
+    Mix_Chunk *bgm = LoadSoundFromArchive(&archive, bgmPath);
 
     bool done = false;
 
     // load resources
-    TTF_Font *font = TTF_OpenFont(fontPath, FONT_SIZE);
-    SDL_Surface *background = IMG_Load(imagePath);
+    Font font = { 0 };
+    LoadFontFromArchive(&font, &archive, fontPath, fontSize);
+    SDL_Surface *background = LoadImageFromArchive(&archive, imagePath);
 
     Vector3 light = Vector3Normalize(&(Vector3){ 0.5f, 0.5f, 1.0f });
     SetupLight(light);
+    SetDithering(true);
+    SetTargetFrameTime(1.0f / 30.0f);
 
     Mesh3d meshTeapot = { 0 };
-    LoadFromObjectFile(&meshTeapot, "assets/obj/teapot.obj");
+    LoadMeshFromArchive(&meshTeapot, &archive, "assets/obj/teapot.obj");
 
     Mesh3d meshCube = { 0 };
-    LoadFromObjectFile(&meshCube, "assets/obj/cube.obj");
+    LoadMeshFromArchive(&meshCube, &archive, "assets/obj/cube.obj");
 
     Mesh3d meshMonkey = { 0 };
-    LoadFromObjectFile(&meshMonkey, "assets/obj/monkey.obj");
+    LoadMeshFromArchive(&meshMonkey, &archive, "assets/obj/monkey.obj");
 
     float fTheta = 0.0f;
     float prevSecs = (float)SDL_GetTicks() / 1000.0f;
@@ -140,10 +81,12 @@ int main(int argc, char **argv) {
     bool printed = false;
     bool wireframe = false;
     bool showdepth = false;
+    bool smooth = false;
     while (!done && !WindowShouldClose()) {
         float now = (float)SDL_GetTicks() / 1000.0f;
         float elapsed = now - prevSecs;
         prevSecs = now;
+        UpdateRenderScale(elapsed);
 
         if (IsKeyDown(BUTTON_R1)) {
             fTheta += elapsed;
@@ -154,6 +97,12 @@ int main(int argc, char **argv) {
 
         if (IsKeyPressed(BUTTON_SELECT)) {
             wireframe = !wireframe;
+            SetWireframe(wireframe, COLOR_GREEN);
+        }
+
+        if (IsKeyPressed(BUTTON_START)) {
+            smooth = !smooth;
+            SetShadingMode(smooth ? SHADING_SMOOTH : SHADING_FLAT);
         }
 
         if (IsKeyPressed(SDLK_0)) {
@@ -192,38 +141,49 @@ int main(int argc, char **argv) {
 
         BeginDrawing();
 
-        DrawRectangle(NULL, COLOR_BLACK);
+        ClearBackground(COLOR_BLACK);
 
         Matrix4 viewMatrix = Matrix_LookAt(&camera.position, &camera.target, &camera.up);
         BeginMode3d(&camera);
 
-        DrawModel(&meshTeapot, (Vector3){0.0f, 0.0f, 5.0f});
+        Matrix4 matRotation = Matrix_MakeRotationY(fTheta);
+        Matrix4 matTranslation = Matrix_MakeTranslation(0.0f, 0.0f, 5.0f);
+        DrawModelEx(&meshTeapot, Matrix_MultiplyMatrix(&matRotation, &matTranslation));
         DrawModel(&meshCube, (Vector3){5.0f, 0.0f, 5.0f});
-        DrawModel(&meshMonkey, (Vector3){-5.0f, 0.0f, 5.0f});
-        DrawModel(&meshMonkey, (Vector3){-5.0f, 5.0f, 5.0f});
-        DrawModel(&meshMonkey, (Vector3){5.0f, -5.0f, 5.0f});
+
+        Matrix4 monkeys[3] = {
+            Matrix_MakeTranslation(-5.0f, 0.0f, 5.0f),
+            Matrix_MakeTranslation(-5.0f, 5.0f, 5.0f),
+            Matrix_MakeTranslation(5.0f, -5.0f, 5.0f),
+        };
+        DrawModelInstanced(&meshMonkey, monkeys, 3);
 
         if (showdepth) {
-            float* depths = Platform_GetDepthBuffer();
+            void *depths = Platform_GetDepthBuffer();
+            int format = Platform_GetDepthFormat();
+            int width = GetRenderWidth();
+            int height = GetRenderHeight();
             float min = MAX_FLOAT;
             float max = MIN_FLOAT;
-            for (int i = 0; i < SCREEN_HEIGHT * SCREEN_WIDTH; i++) {
-                if (depths[i] != MIN_FLOAT) {
-                    if (depths[i] < min) {
-                        min = depths[i];
+            for (int i = 0; i < height * width; i++) {
+                float depth = readDepth(depths, format, i);
+                if (depth != MIN_FLOAT) {
+                    if (depth < min) {
+                        min = depth;
                     }
-                    if (depths[i] > max) {
-                        max = depths[i];
+                    if (depth > max) {
+                        max = depth;
                     }
                 }
             }
-            Uint32 *pixels = (Uint32*)Platform_GetScreenSurface()->pixels;
+            SDL_Surface *screen = Platform_GetScreenSurface();
 
-            for (int i = 0; i < SCREEN_HEIGHT * SCREEN_WIDTH; i++) {
-                float v = depths[i] == MIN_FLOAT ? min : depths[i];
+            for (int i = 0; i < height * width; i++) {
+                float depth = readDepth(depths, format, i);
+                float v = depth == MIN_FLOAT ? min : depth;
                 float c = 255 * (v - min) / (max - min);
-                pixels[i] = SDL_MapRGB(Platform_GetScreenSurface()->format,
-                    c, c, c);
+                Pixel *row = (Pixel*)((Uint8*)screen->pixels + (i / width) * screen->pitch);
+                row[i % width] = SDL_MapRGB(screen->format, c, c, c);
             }
         }
 
@@ -231,19 +191,23 @@ int main(int argc, char **argv) {
 
         char str[100];
         sprintf(str, "%3.2f FPS", 1.0f / elapsed);
-        DrawTextEx(font, str, (Vector2){5, 5}, COLOR_WHITE);
+        DrawTextEx(&font, str, (Vector2){5, 5}, COLOR_WHITE);
         EndDrawing();
     }
-    free(meshCube.polygons);
+    UnloadMesh(&meshTeapot);
+    UnloadMesh(&meshCube);
+    UnloadMesh(&meshMonkey);
 
     Mix_HaltChannel(-1);
 
     Mix_FreeChunk(sfx);
     Mix_FreeChunk(bgm);
 
-    TTF_CloseFont(font);
+    UnloadFont(&font);
 
     SDL_FreeSurface(background);
 
+    UnloadArchive(&archive);
+
     return CloseWindow();
 }
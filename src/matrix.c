@@ -1,5 +1,13 @@
 #include "matrix.h"
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define MATRIX_NEON
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#define MATRIX_SSE
+#endif
+
 Matrix4 IdentityMatrix() {
     Matrix4 m = { 0 };
     m.m[0][0] = 1.0f;
@@ -82,6 +90,106 @@ Vector4 Matrix_MultiplyVector(Matrix4 mat, Vector4 in) {
     return out;
 }
 
+#if defined(MATRIX_NEON)
+// Transposes 4 AoS points into x/y/z registers and applies mat
+#define NEON_TRANSFORM4(mat, in, x, y, z, w) do {                                              \
+        float32x4x4_t v = vld4q_f32((const float*)(in));                                       \
+        x = vmlaq_n_f32(vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32((mat)->m[3][0]),                   \
+                v.val[0], (mat)->m[0][0]), v.val[1], (mat)->m[1][0]), v.val[2], (mat)->m[2][0]); \
+        y = vmlaq_n_f32(vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32((mat)->m[3][1]),                   \
+                v.val[0], (mat)->m[0][1]), v.val[1], (mat)->m[1][1]), v.val[2], (mat)->m[2][1]); \
+        z = vmlaq_n_f32(vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32((mat)->m[3][2]),                   \
+                v.val[0], (mat)->m[0][2]), v.val[1], (mat)->m[1][2]), v.val[2], (mat)->m[2][2]); \
+        w = vmlaq_n_f32(vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32((mat)->m[3][3]),                   \
+                v.val[0], (mat)->m[0][3]), v.val[1], (mat)->m[1][3]), v.val[2], (mat)->m[2][3]); \
+    } while (0)
+#elif defined(MATRIX_SSE)
+#define SSE_ROW(mat, x, y, z, c)                                                                  \
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps((mat)->m[0][c])),                         \
+                              _mm_mul_ps(y, _mm_set1_ps((mat)->m[1][c]))),                        \
+                   _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps((mat)->m[2][c])), _mm_set1_ps((mat)->m[3][c])))
+
+// Transposes 4 AoS points into x/y/z registers and applies mat
+#define SSE_TRANSFORM4(mat, in, x, y, z, w) do {                   \
+        __m128 r0 = _mm_loadu_ps((const float*)&(in)[0]);          \
+        __m128 r1 = _mm_loadu_ps((const float*)&(in)[1]);          \
+        __m128 r2 = _mm_loadu_ps((const float*)&(in)[2]);          \
+        __m128 r3 = _mm_loadu_ps((const float*)&(in)[3]);          \
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);                         \
+        x = SSE_ROW(mat, r0, r1, r2, 0);                           \
+        y = SSE_ROW(mat, r0, r1, r2, 1);                           \
+        z = SSE_ROW(mat, r0, r1, r2, 2);                           \
+        w = SSE_ROW(mat, r0, r1, r2, 3);                           \
+    } while (0)
+#endif
+
+static inline void transformPoint(const Matrix4 *mat, const Vector4 *in, float *x, float *y, float *z, float *w) {
+    *x = in->x * mat->m[0][0] + in->y * mat->m[1][0] + in->z * mat->m[2][0] + mat->m[3][0];
+    *y = in->x * mat->m[0][1] + in->y * mat->m[1][1] + in->z * mat->m[2][1] + mat->m[3][1];
+    *z = in->x * mat->m[0][2] + in->y * mat->m[1][2] + in->z * mat->m[2][2] + mat->m[3][2];
+    *w = in->x * mat->m[0][3] + in->y * mat->m[1][3] + in->z * mat->m[2][3] + mat->m[3][3];
+}
+
+void Matrix_ProjectPoints(const Matrix4 *mat, const Vector4 *in, int count,
+                          float *clip[4], float *screen[3], float halfWidth, float halfHeight) {
+    int i = 0;
+
+    // X/Y come out inverted, so the viewport mapping is
+    // (1 - x / w) * halfWidth and (1 - y / w) * halfHeight
+#if defined(MATRIX_NEON)
+    float32x4_t hw = vdupq_n_f32(halfWidth);
+    float32x4_t hh = vdupq_n_f32(halfHeight);
+    for (; i + 4 <= count; i += 4) {
+        float32x4_t x, y, z, w;
+        NEON_TRANSFORM4(mat, &in[i], x, y, z, w);
+        vst1q_f32(&clip[0][i], x);
+        vst1q_f32(&clip[1][i], y);
+        vst1q_f32(&clip[2][i], z);
+        vst1q_f32(&clip[3][i], w);
+
+        // No divide on ARMv7 NEON: estimate plus two Newton-Raphson steps
+        float32x4_t rw = vrecpeq_f32(w);
+        rw = vmulq_f32(vrecpsq_f32(w, rw), rw);
+        rw = vmulq_f32(vrecpsq_f32(w, rw), rw);
+
+        vst1q_f32(&screen[0][i], vmlsq_f32(hw, vmulq_f32(x, rw), hw));
+        vst1q_f32(&screen[1][i], vmlsq_f32(hh, vmulq_f32(y, rw), hh));
+        vst1q_f32(&screen[2][i], vnegq_f32(vmulq_f32(z, rw)));
+    }
+#elif defined(MATRIX_SSE)
+    __m128 hw = _mm_set1_ps(halfWidth);
+    __m128 hh = _mm_set1_ps(halfHeight);
+    __m128 zero = _mm_setzero_ps();
+    for (; i + 4 <= count; i += 4) {
+        __m128 x, y, z, w;
+        SSE_TRANSFORM4(mat, &in[i], x, y, z, w);
+        _mm_storeu_ps(&clip[0][i], x);
+        _mm_storeu_ps(&clip[1][i], y);
+        _mm_storeu_ps(&clip[2][i], z);
+        _mm_storeu_ps(&clip[3][i], w);
+
+        __m128 rw = _mm_div_ps(_mm_set1_ps(1.0f), w);
+        _mm_storeu_ps(&screen[0][i], _mm_sub_ps(hw, _mm_mul_ps(_mm_mul_ps(x, rw), hw)));
+        _mm_storeu_ps(&screen[1][i], _mm_sub_ps(hh, _mm_mul_ps(_mm_mul_ps(y, rw), hh)));
+        _mm_storeu_ps(&screen[2][i], _mm_sub_ps(zero, _mm_mul_ps(z, rw)));
+    }
+#endif
+
+    for (; i < count; i++) {
+        float x, y, z, w;
+        transformPoint(mat, &in[i], &x, &y, &z, &w);
+        clip[0][i] = x;
+        clip[1][i] = y;
+        clip[2][i] = z;
+        clip[3][i] = w;
+
+        float rw = 1.0f / w;
+        screen[0][i] = halfWidth - x * rw * halfWidth;
+        screen[1][i] = halfHeight - y * rw * halfHeight;
+        screen[2][i] = -(z * rw);
+    }
+}
+
 Matrix4 Matrix_MultiplyMatrix(Matrix4 *m1, Matrix4 *m2) {
     Matrix4 res = { 0 };
 
@@ -97,6 +205,35 @@ Matrix4 Matrix_MultiplyMatrix(Matrix4 *m1, Matrix4 *m2) {
     return res;
 }
 
+Matrix4 Matrix_InverseAffine(const Matrix4 *m)
+{
+    // Inverse of the upper 3x3 through its cofactors, the last column is (0, 0, 0, 1)
+    float c00 = m->m[1][1] * m->m[2][2] - m->m[1][2] * m->m[2][1];
+    float c01 = m->m[1][2] * m->m[2][0] - m->m[1][0] * m->m[2][2];
+    float c02 = m->m[1][0] * m->m[2][1] - m->m[1][1] * m->m[2][0];
+    float det = m->m[0][0] * c00 + m->m[0][1] * c01 + m->m[0][2] * c02;
+    float rdet = det != 0.0f ? 1.0f / det : 0.0f;
+
+    Matrix4 matrix = { 0 };
+    matrix.m[0][0] = c00 * rdet;
+    matrix.m[1][0] = c01 * rdet;
+    matrix.m[2][0] = c02 * rdet;
+    matrix.m[0][1] = (m->m[0][2] * m->m[2][1] - m->m[0][1] * m->m[2][2]) * rdet;
+    matrix.m[1][1] = (m->m[0][0] * m->m[2][2] - m->m[0][2] * m->m[2][0]) * rdet;
+    matrix.m[2][1] = (m->m[0][1] * m->m[2][0] - m->m[0][0] * m->m[2][1]) * rdet;
+    matrix.m[0][2] = (m->m[0][1] * m->m[1][2] - m->m[0][2] * m->m[1][1]) * rdet;
+    matrix.m[1][2] = (m->m[0][2] * m->m[1][0] - m->m[0][0] * m->m[1][2]) * rdet;
+    matrix.m[2][2] = (m->m[0][0] * m->m[1][1] - m->m[0][1] * m->m[1][0]) * rdet;
+
+    // Translation undone through the inverted rotation/scale
+    for (int c = 0; c < 3; c++) {
+        matrix.m[3][c] = -(m->m[3][0] * matrix.m[0][c] + m->m[3][1] * matrix.m[1][c] + m->m[3][2] * matrix.m[2][c]);
+    }
+    matrix.m[3][3] = 1.0f;
+
+    return matrix;
+}
+
 Matrix4 Matrix_LookAt(Vector3 *pos, Vector3 *target, Vector3 *up)
 {
     // Calculate new forward direction
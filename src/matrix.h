@@ -2,13 +2,15 @@
 #define MATRIX_H
 
 #include "math.h"
-#include "core.h"
 
 typedef struct Matrix4
 {
     float m[4][4];
 } Matrix4;
 
+// After Matrix4, which core.h uses in turn
+#include "core.h"
+
 Matrix4 IdentityMatrix();
 
 Matrix4 Matrix_MakeRotationX(float angleRad);
@@ -18,9 +20,19 @@ Matrix4 Matrix_MakeTranslation(float x, float y, float z);
 Matrix4 Matrix_MakeProjection(float fFovDegrees, float fAspectRatio, float fNear, float fFar);
 
 Vector4 Matrix_MultiplyVector(Matrix4 mat, Vector4 in);
+
+// Batch transforms of `count` positions (w is taken as 1) read from `in`, in
+// structure-of-arrays layout: clip[0..3] hold x, y, z, w, and after the
+// perspective divide and viewport mapping screen[0..2] hold the screen x, y
+// and the depth (-z / w).
+void Matrix_ProjectPoints(const Matrix4 *mat, const Vector4 *in, int count,
+                          float *clip[4], float *screen[3], float halfWidth, float halfHeight);
 Matrix4 Matrix_MultiplyMatrix(Matrix4 *m1, Matrix4 *m2);
 Matrix4 Matrix_LookAt(Vector3 *pos, Vector3 *target, Vector3 *up);
 Matrix4 Matrix_QuickInverse(Matrix4 *m);
+// Inverse of a matrix whose last column is (0, 0, 0, 1): any combination of
+// rotation, scale and translation. Singular matrices give a zero 3x3 part.
+Matrix4 Matrix_InverseAffine(const Matrix4 *m);
 
 void PrintMatrix(Matrix4 *mat);
 
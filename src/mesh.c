@@ -0,0 +1,368 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "math.h"
+#include "string.h"
+
+#include "kvec.h"
+
+#include "core.h"
+
+// The whole file is read into one buffer and parsed in place
+
+static const char *skipSpaces(const char *p)
+{
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    return p;
+}
+
+static const char *skipLine(const char *p)
+{
+    while (*p != '\0' && *p != '\n') {
+        p++;
+    }
+    return *p == '\n' ? p + 1 : p;
+}
+
+static bool isDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// Reads a decimal number with an optional sign, fraction and exponent.
+// Returns where it ends, `p` itself when there is no number.
+static const char *parseFloat(const char *p, float *res)
+{
+    // Powers of ten that doubles hold exactly
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+
+    const char *start = p;
+    bool negative = *p == '-';
+    if (*p == '-' || *p == '+') {
+        p++;
+    }
+
+    // Up to 19 significant digits, which fit 64 bits
+    Uint64 mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool found = false;
+    for (; isDigit(*p); p++) {
+        found = true;
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa != 0;
+        } else {
+            exponent++;
+        }
+    }
+    if (*p == '.') {
+        for (p++; isDigit(*p); p++) {
+            found = true;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa != 0;
+                exponent--;
+            }
+        }
+    }
+    if (!found) {
+        return start;
+    }
+
+    if (*p == 'e' || *p == 'E') {
+        const char *q = p + 1;
+        bool negativeExponent = *q == '-';
+        if (*q == '-' || *q == '+') {
+            q++;
+        }
+        if (isDigit(*q)) {
+            int value = 0;
+            for (; isDigit(*q); q++) {
+                value = MIN(value * 10 + (*q - '0'), 9999);
+            }
+            exponent += negativeExponent ? -value : value;
+            p = q;
+        }
+    }
+
+    double value = (double)mantissa;
+    if (exponent < 0) {
+        value = -exponent <= 22 ? value / powers[-exponent] : value * pow(10.0, exponent);
+    } else if (exponent > 0) {
+        value = exponent <= 22 ? value * powers[exponent] : value * pow(10.0, exponent);
+    }
+    *res = (float)(negative ? -value : value);
+
+    return p;
+}
+
+static const char *parseInt(const char *p, int *res)
+{
+    const char *start = p;
+    bool negative = *p == '-';
+    if (*p == '-' || *p == '+') {
+        p++;
+    }
+    if (!isDigit(*p)) {
+        return start;
+    }
+
+    // Saturates far beyond any vertex count
+    int value = 0;
+    for (; isDigit(*p); p++) {
+        if (value < 100000000) {
+            value = value * 10 + (*p - '0');
+        }
+    }
+    *res = negative ? -value : value;
+
+    return p;
+}
+
+static char *readFile(const char *filename)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL)
+    {
+        return NULL;
+    }
+
+    char *data = NULL;
+    long size = fseek(fp, 0, SEEK_END) == 0 ? ftell(fp) : -1;
+    if (size >= 0 && fseek(fp, 0, SEEK_SET) == 0) {
+        data = (char*)malloc(size + 1);
+        if (data != NULL && fread(data, 1, size, fp) != (size_t)size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(fp);
+
+    if (data != NULL) {
+        data[size] = '\0';
+    }
+    return data;
+}
+
+// Positions and faces only: texture coordinates and normals are skipped,
+// normals are computed from the faces instead. Faces may use any of the
+// v, v/vt, v//vn and v/vt/vn forms and relative indices, polygons are split
+// into a fan of triangles.
+bool LoadFromObjectFile(Mesh3d *res, const char *filename)
+{
+    memset(res, 0, sizeof(Mesh3d));
+
+    char *data = readFile(filename);
+    if (data == NULL)
+    {
+        return false;
+    }
+
+    kvec_t(Vector4) verts;
+    kv_init(verts);
+
+    // Faces keep referencing the shared verts instead of copying them
+    kvec_t(int) indices;
+    kv_init(indices);
+
+    for (const char *line = data; *line != '\0'; line = skipLine(line)) {
+        const char *p = skipSpaces(line);
+
+        if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            Vector4 v = MakeVector4();
+            p = parseFloat(skipSpaces(p + 2), &v.x);
+            p = parseFloat(skipSpaces(p), &v.y);
+            parseFloat(skipSpaces(p), &v.z);
+            kv_push(Vector4, verts, v);
+        }
+        else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            int first = 0, previous = 0, corners = 0;
+            p += 2;
+            for (;;) {
+                int index;
+                p = skipSpaces(p);
+                const char *end = parseInt(p, &index);
+                if (end == p) {
+                    break;
+                }
+                // Past the texture coordinate and normal indices
+                while (*end == '/' || *end == '-' || *end == '+' || isDigit(*end)) {
+                    end++;
+                }
+                p = end;
+
+                // 1-based, or counting back from the last vertex when negative
+                index = index < 0 ? (int)kv_size(verts) + index : index - 1;
+                if (corners == 0) {
+                    first = index;
+                } else if (corners >= 2) {
+                    kv_push(int, indices, first);
+                    kv_push(int, indices, previous);
+                    kv_push(int, indices, index);
+                }
+                previous = index;
+                corners++;
+            }
+        }
+    }
+    free(data);
+
+    // Faces referring to vertices that don't exist are dropped
+    int vertexCount = kv_size(verts);
+    int triangleCount = 0;
+    for (size_t i = 0; i < kv_size(indices); i += 3) {
+        int *face = &kv_A(indices, i);
+        if (face[0] < 0 || face[0] >= vertexCount || face[1] < 0 || face[1] >= vertexCount ||
+            face[2] < 0 || face[2] >= vertexCount) {
+            continue;
+        }
+        memmove(&kv_A(indices, triangleCount * 3), face, sizeof(int) * 3);
+        triangleCount++;
+    }
+
+    res->vertices = verts.a;
+    res->vertexCount = vertexCount;
+    res->indices = indices.a;
+    res->triangleCount = triangleCount;
+    res->mapped = false;
+    UpdateMeshBounds(res);
+    UpdateMeshNormals(res);
+    GenerateMeshLods(res);
+
+    return true;
+}
+
+void UpdateMeshBounds(Mesh3d *mesh)
+{
+    if (mesh->vertexCount == 0)
+    {
+        mesh->boundsMin = mesh->boundsMax = mesh->boundsCenter = (Vector3){ 0.0f, 0.0f, 0.0f };
+        mesh->boundsRadius = 0.0f;
+        return;
+    }
+
+    Vector3 min = MakeVector3FromVector4(mesh->vertices[0]);
+    Vector3 max = min;
+    for (int i = 1; i < mesh->vertexCount; i++) {
+        Vector4 v = mesh->vertices[i];
+        min = (Vector3){ MIN(min.x, v.x), MIN(min.y, v.y), MIN(min.z, v.z) };
+        max = (Vector3){ MAX(max.x, v.x), MAX(max.y, v.y), MAX(max.z, v.z) };
+    }
+
+    // The sphere is centered on the box, which is tight enough for culling
+    Vector3 center = Vector3Mul(Vector3Add(min, max), 0.5f);
+    float radiusSq = 0.0f;
+    for (int i = 0; i < mesh->vertexCount; i++) {
+        Vector3 d = Vector3Sub(MakeVector3FromVector4(mesh->vertices[i]), center);
+        radiusSq = MAX(radiusSq, Vector3DotProduct(d, d));
+    }
+
+    mesh->boundsMin = min;
+    mesh->boundsMax = max;
+    mesh->boundsCenter = center;
+    mesh->boundsRadius = sqrtf(radiusSq);
+}
+
+typedef struct VertexKey {
+    Vector3 position;
+    int index;
+} VertexKey;
+
+static int compareVertexKeys(const void *a, const void *b)
+{
+    const Vector3 *pa = &((const VertexKey*)a)->position;
+    const Vector3 *pb = &((const VertexKey*)b)->position;
+
+    if (pa->x != pb->x) return pa->x < pb->x ? -1 : 1;
+    if (pa->y != pb->y) return pa->y < pb->y ? -1 : 1;
+    if (pa->z != pb->z) return pa->z < pb->z ? -1 : 1;
+    return 0;
+}
+
+// Vertices duplicated at the same position (seams of the exporter's patches)
+// share one normal, otherwise smooth shading shows the seam
+static void weldVertexNormals(Mesh3d *mesh)
+{
+    VertexKey *keys = (VertexKey*)malloc(sizeof(VertexKey) * MAX(mesh->vertexCount, 1));
+    for (int i = 0; i < mesh->vertexCount; i++) {
+        keys[i] = (VertexKey){ MakeVector3FromVector4(mesh->vertices[i]), i };
+    }
+    qsort(keys, mesh->vertexCount, sizeof(VertexKey), compareVertexKeys);
+
+    for (int start = 0, end; start < mesh->vertexCount; start = end) {
+        Vector3 sum = mesh->vertexNormals[keys[start].index];
+        for (end = start + 1; end < mesh->vertexCount && compareVertexKeys(&keys[start], &keys[end]) == 0; end++) {
+            sum = Vector3Add(sum, mesh->vertexNormals[keys[end].index]);
+        }
+        for (int i = start; i < end; i++) {
+            mesh->vertexNormals[keys[i].index] = sum;
+        }
+    }
+
+    free(keys);
+}
+
+void UpdateMeshNormals(Mesh3d *mesh)
+{
+    mesh->faceNormals = (Vector4*)realloc(mesh->faceNormals, sizeof(Vector4) * MAX(mesh->triangleCount, 1));
+    mesh->vertexNormals = (Vector3*)realloc(mesh->vertexNormals, sizeof(Vector3) * MAX(mesh->vertexCount, 1));
+    memset(mesh->vertexNormals, 0, sizeof(Vector3) * mesh->vertexCount);
+
+    for (int i = 0; i < mesh->triangleCount; i++) {
+        const int *face = &mesh->indices[i * 3];
+        Vector3 a = MakeVector3FromVector4(mesh->vertices[face[0]]);
+        Vector3 b = MakeVector3FromVector4(mesh->vertices[face[1]]);
+        Vector3 c = MakeVector3FromVector4(mesh->vertices[face[2]]);
+
+        Vector3 normal = Vector3CrossProduct(Vector3Sub(b, a), Vector3Sub(c, a));
+
+        // Vertices average the faces around them weighted by area,
+        // which is the length of the cross product
+        for (int k = 0; k < 3; k++) {
+            mesh->vertexNormals[face[k]] = Vector3Add(mesh->vertexNormals[face[k]], normal);
+        }
+
+        float length = sqrtf(Vector3DotProduct(normal, normal));
+        // Degenerate faces get a zero normal, which culls them
+        normal = length > 0.0f ? Vector3Mul(normal, 1.0f / length) : normal;
+
+        mesh->faceNormals[i] = (Vector4){ normal.x, normal.y, normal.z, -Vector3DotProduct(normal, a) };
+    }
+
+    weldVertexNormals(mesh);
+    for (int i = 0; i < mesh->vertexCount; i++) {
+        Vector3 normal = mesh->vertexNormals[i];
+        float length = sqrtf(Vector3DotProduct(normal, normal));
+        mesh->vertexNormals[i] = length > 0.0f ? Vector3Mul(normal, 1.0f / length) : normal;
+    }
+}
+
+void UnloadMesh(Mesh3d *mesh)
+{
+    for (int i = 0; i < mesh->lodCount; i++) {
+        UnloadMesh(&mesh->lods[i]);
+    }
+    free(mesh->lods);
+    mesh->lods = NULL;
+    mesh->lodCount = 0;
+
+    if (!mesh->mapped) {
+        free(mesh->vertices);
+        free(mesh->indices);
+        free(mesh->faceNormals);
+        free(mesh->vertexNormals);
+    }
+
+    mesh->vertices = NULL;
+    mesh->indices = NULL;
+    mesh->faceNormals = NULL;
+    mesh->vertexNormals = NULL;
+    mesh->vertexCount = 0;
+    mesh->triangleCount = 0;
+}
@@ -0,0 +1,152 @@
+#include "stdlib.h"
+#include "math.h"
+
+#include "core.h"
+
+// Raw value of pixel (x, y), for surfaces of any depth
+static Uint32 surfacePixel(const SDL_Surface *surface, int x, int y)
+{
+    const Uint8 *p = (const Uint8*)surface->pixels + y * surface->pitch + x * surface->format->BytesPerPixel;
+    switch (surface->format->BytesPerPixel) {
+    case 1: return *p;
+    case 2: return *(const Uint16*)p;
+    case 3:
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+        return (p[0] << 16) | (p[1] << 8) | p[2];
+#else
+        return p[0] | (p[1] << 8) | (p[2] << 16);
+#endif
+    default: return *(const Uint32*)p;
+    }
+}
+
+// Converts `image` into the atlas with its top left at (left, top).
+// Returns true when some of its pixels are transparent.
+static bool copyImage(SpriteAtlas *atlas, SDL_Surface *image, int left, int top, const SDL_PixelFormat *format)
+{
+    bool keyed = (image->flags & SDL_SRCCOLORKEY) != 0;
+    bool transparent = false;
+
+    // Opaque pixels that happen to map to the key move off it by the
+    // lowest bit of blue
+    Pixel nudge = (Pixel)(format->Bmask & -format->Bmask);
+
+    SDL_LockSurface(image);
+    for (int y = 0; y < image->h; y++) {
+        Pixel *row = atlas->pixels + (top + y) * atlas->width + left;
+        for (int x = 0; x < image->w; x++) {
+            Uint32 raw = surfacePixel(image, x, y);
+            Uint8 r, g, b, a;
+            SDL_GetRGBA(raw, image->format, &r, &g, &b, &a);
+
+            if ((keyed && raw == image->format->colorkey) || a < 128) {
+                row[x] = atlas->colorkey;
+                transparent = true;
+                continue;
+            }
+            Pixel pixel = SDL_MapRGB(format, r, g, b);
+            row[x] = pixel == atlas->colorkey ? pixel ^ nudge : pixel;
+        }
+    }
+    SDL_UnlockSurface(image);
+
+    return transparent;
+}
+
+typedef struct PackItem {
+    int index;
+    int height;
+} PackItem;
+
+static int compareHeights(const void *a, const void *b)
+{
+    const PackItem *ia = (const PackItem*)a;
+    const PackItem *ib = (const PackItem*)b;
+
+    if (ia->height != ib->height) {
+        return ib->height - ia->height;
+    }
+    return ia->index - ib->index;
+}
+
+bool CreateSpriteAtlas(SpriteAtlas *res, SDL_Surface **images, int count, SDL_Rect *rects)
+{
+    SDL_PixelFormat *format = Platform_GetScreenFormat();
+
+    PackItem *items = (PackItem*)malloc(sizeof(PackItem) * MAX(count, 1));
+    if (items == NULL)
+    {
+        return false;
+    }
+
+    int area = 0, widest = 1;
+    for (int i = 0; i < count; i++) {
+        items[i] = (PackItem){ i, images[i]->h };
+        area += images[i]->w * images[i]->h;
+        widest = MAX(widest, images[i]->w);
+    }
+
+    // Shelf packing, tallest first, into a roughly square atlas
+    qsort(items, count, sizeof(PackItem), compareHeights);
+    int width = MAX(widest, (int)ceilf(sqrtf((float)area)));
+    int x = 0, y = 0, shelfHeight = 0;
+    for (int i = 0; i < count; i++) {
+        SDL_Surface *image = images[items[i].index];
+        if (x + image->w > width) {
+            x = 0;
+            y += shelfHeight;
+            shelfHeight = 0;
+        }
+        rects[items[i].index] = (SDL_Rect){ (Sint16)x, (Sint16)y, (Uint16)image->w, (Uint16)image->h };
+        x += image->w;
+        shelfHeight = MAX(shelfHeight, image->h);
+    }
+    free(items);
+
+    res->width = width;
+    res->height = MAX(y + shelfHeight, 1);
+    res->colorkey = SDL_MapRGB(format, 255, 0, 255);
+    res->keyed = false;
+    res->pixels = (Pixel*)malloc(sizeof(Pixel) * res->width * res->height);
+    if (res->pixels == NULL)
+    {
+        return false;
+    }
+
+    // Gaps between the images stay transparent
+    for (int i = 0; i < res->width * res->height; i++) {
+        res->pixels[i] = res->colorkey;
+    }
+    for (int i = 0; i < count; i++) {
+        if (copyImage(res, images[i], rects[i].x, rects[i].y, format)) {
+            res->keyed = true;
+        }
+    }
+
+    return true;
+}
+
+bool LoadSpriteAtlas(SpriteAtlas *res, const char *filename)
+{
+    SDL_Surface *image = IMG_Load(filename);
+    if (image == NULL)
+    {
+        return false;
+    }
+
+    // A single image is placed at the origin
+    SDL_Rect rect;
+    bool loaded = CreateSpriteAtlas(res, &image, 1, &rect);
+    SDL_FreeSurface(image);
+
+    return loaded;
+}
+
+void UnloadSpriteAtlas(SpriteAtlas *atlas)
+{
+    free(atlas->pixels);
+
+    atlas->pixels = NULL;
+    atlas->width = 0;
+    atlas->height = 0;
+}
@@ -0,0 +1,87 @@
+#include "stdlib.h"
+
+#include "core.h"
+
+int TextureOffset(const Texture *texture, int u, int v)
+{
+    if (!texture->tiled) {
+        return (v << texture->widthShift) | u;
+    }
+
+    const int mask = TEXTURE_TILE - 1;
+    return ((v & ~mask) << texture->widthShift)
+         | ((u & ~mask) << TEXTURE_TILE_SHIFT)
+         | ((v & mask) << TEXTURE_TILE_SHIFT)
+         | (u & mask);
+}
+
+static int shiftForSize(int size)
+{
+    // Tiled textures need whole tiles
+    int shift = TEXTURE_TILE_SHIFT;
+    while ((1 << shift) < size) {
+        shift++;
+    }
+    return shift;
+}
+
+bool CreateTexture(Texture *res, SDL_Surface *image, bool tiled)
+{
+    SDL_Surface *converted = SDL_ConvertSurface(image, Platform_GetScreenFormat(), SDL_SWSURFACE);
+    if (converted == NULL)
+    {
+        return false;
+    }
+
+    res->width = converted->w;
+    res->height = converted->h;
+    res->widthShift = shiftForSize(converted->w);
+    res->heightShift = shiftForSize(converted->h);
+    res->tiled = tiled;
+
+    int paddedWidth = 1 << res->widthShift;
+    int paddedHeight = 1 << res->heightShift;
+    res->pixels = (Pixel*)malloc(sizeof(Pixel) * paddedWidth * paddedHeight);
+    if (res->pixels == NULL)
+    {
+        SDL_FreeSurface(converted);
+        return false;
+    }
+
+    SDL_LockSurface(converted);
+    for (int v = 0; v < paddedHeight; v++) {
+        // Padding repeats the last row and column of the image
+        const Pixel *row = (const Pixel*)((const Uint8*)converted->pixels
+            + MIN(v, converted->h - 1) * converted->pitch);
+        for (int u = 0; u < paddedWidth; u++) {
+            res->pixels[TextureOffset(res, u, v)] = row[MIN(u, converted->w - 1)];
+        }
+    }
+    SDL_UnlockSurface(converted);
+    SDL_FreeSurface(converted);
+
+    return true;
+}
+
+bool LoadTexture(Texture *res, const char *filename, bool tiled)
+{
+    SDL_Surface *image = IMG_Load(filename);
+    if (image == NULL)
+    {
+        return false;
+    }
+
+    bool loaded = CreateTexture(res, image, tiled);
+    SDL_FreeSurface(image);
+
+    return loaded;
+}
+
+void UnloadTexture(Texture *texture)
+{
+    free(texture->pixels);
+
+    texture->pixels = NULL;
+    texture->width = 0;
+    texture->height = 0;
+}
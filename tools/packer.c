@@ -0,0 +1,300 @@
+// Packs assets into an archive for LoadArchive, converted to what the loaders
+// would otherwise make of them at startup.
+//
+//   packer <archive> <file>...
+//
+// Images (.png, .jpg, .bmp), meshes (.obj) and sounds (.wav, .ogg) are packed
+// under their path. Fonts are rasterized at one size each, given as
+// "font.ttf:24". Built for the host by `make pack`, with the same BPP as the
+// app.
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "strings.h"
+
+#include "kvec.h"
+
+#include "core.h"
+#include "archive.h"
+
+typedef kvec_t(Uint8) Blob;
+
+typedef struct PackedEntry {
+    ArchiveEntry entry;
+    Blob blob;
+} PackedEntry;
+
+// Appends `size` bytes, ARCHIVE_ALIGN aligned, and returns their offset.
+// Zeros when `data` is NULL.
+static Uint32 appendBlob(Blob *blob, const void *data, size_t size)
+{
+    size_t offset = (kv_size(*blob) + ARCHIVE_ALIGN - 1) / ARCHIVE_ALIGN * ARCHIVE_ALIGN;
+    size_t end = offset + size;
+    if (end > kv_max(*blob)) {
+        kv_resize(Uint8, *blob, MAX(end, kv_max(*blob) * 2));
+    }
+
+    memset(blob->a + kv_size(*blob), 0, offset - kv_size(*blob));
+    if (data != NULL) {
+        memcpy(blob->a + offset, data, size);
+    } else {
+        memset(blob->a + offset, 0, size);
+    }
+    kv_size(*blob) = end;
+
+    return (Uint32)offset;
+}
+
+static bool hasExtension(const char *filename, const char *extension)
+{
+    size_t length = strlen(filename), extensionLength = strlen(extension);
+    return length >= extensionLength && strcasecmp(filename + length - extensionLength, extension) == 0;
+}
+
+static bool packImage(Blob *blob, const char *filename)
+{
+    SDL_Surface *image = IMG_Load(filename);
+    if (image == NULL)
+    {
+        return false;
+    }
+
+    // The screen format, as the app creates its frame, or ARGB8888 to keep
+    // an alpha channel
+    SDL_Surface *target = image->format->Amask != 0
+        ? SDL_CreateRGBSurface(SDL_SWSURFACE, 1, 1, 32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000)
+        : SDL_CreateRGBSurface(SDL_SWSURFACE, 1, 1, BITS_PER_PIXEL, 0, 0, 0, 0);
+    SDL_Surface *converted = SDL_ConvertSurface(image, target->format, SDL_SWSURFACE);
+    SDL_FreeSurface(target);
+    SDL_FreeSurface(image);
+    if (converted == NULL)
+    {
+        return false;
+    }
+
+    SDL_PixelFormat *format = converted->format;
+    ArchiveImage header = {
+        (Uint32)converted->w, (Uint32)converted->h, converted->pitch,
+        format->BitsPerPixel,
+        format->Rmask, format->Gmask, format->Bmask, format->Amask,
+        converted->flags & (SDL_SRCCOLORKEY | SDL_SRCALPHA),
+        format->colorkey,
+        0,
+    };
+    appendBlob(blob, &header, sizeof(header));
+
+    SDL_LockSurface(converted);
+    Uint32 pixels = appendBlob(blob, converted->pixels, (size_t)converted->pitch * converted->h);
+    SDL_UnlockSurface(converted);
+    SDL_FreeSurface(converted);
+
+    ((ArchiveImage*)blob->a)->pixels = pixels;
+    return true;
+}
+
+// Writes the header of `mesh` at `at` and its arrays and levels of detail
+// after everything packed so far
+static void packMeshLevel(Blob *blob, Uint32 at, const Mesh3d *mesh)
+{
+    ArchiveMesh header = { 0 };
+    header.vertexCount = mesh->vertexCount;
+    header.triangleCount = mesh->triangleCount;
+    header.vertices = appendBlob(blob, mesh->vertices, sizeof(Vector4) * mesh->vertexCount);
+    header.indices = appendBlob(blob, mesh->indices, sizeof(int) * 3 * mesh->triangleCount);
+    header.faceNormals = appendBlob(blob, mesh->faceNormals, sizeof(Vector4) * mesh->triangleCount);
+    header.vertexNormals = appendBlob(blob, mesh->vertexNormals, sizeof(Vector3) * mesh->vertexCount);
+    header.boundsMin = mesh->boundsMin;
+    header.boundsMax = mesh->boundsMax;
+    header.boundsCenter = mesh->boundsCenter;
+    header.boundsRadius = mesh->boundsRadius;
+    header.lodError = mesh->lodError;
+    header.lodCount = mesh->lodCount;
+    header.lods = appendBlob(blob, NULL, sizeof(ArchiveMesh) * mesh->lodCount);
+    memcpy(blob->a + at, &header, sizeof(header));
+
+    for (int i = 0; i < mesh->lodCount; i++) {
+        packMeshLevel(blob, header.lods + i * sizeof(ArchiveMesh), &mesh->lods[i]);
+    }
+}
+
+static bool packMesh(Blob *blob, const char *filename)
+{
+    Mesh3d mesh = { 0 };
+    if (!LoadFromObjectFile(&mesh, filename))
+    {
+        return false;
+    }
+
+    Uint32 at = appendBlob(blob, NULL, sizeof(ArchiveMesh));
+    packMeshLevel(blob, at, &mesh);
+    UnloadMesh(&mesh);
+
+    return true;
+}
+
+static bool packSound(Blob *blob, const char *filename)
+{
+    ArchiveSound header = { 0 };
+    Uint16 format;
+    if (!Mix_QuerySpec(&header.frequency, &format, &header.channels))
+    {
+        return false;
+    }
+    header.format = format;
+
+    Mix_Chunk *chunk = Mix_LoadWAV(filename);
+    if (chunk == NULL)
+    {
+        return false;
+    }
+
+    header.length = chunk->alen;
+    appendBlob(blob, &header, sizeof(header));
+    Uint32 samples = appendBlob(blob, chunk->abuf, chunk->alen);
+    Mix_FreeChunk(chunk);
+
+    ((ArchiveSound*)blob->a)->samples = samples;
+    return true;
+}
+
+static bool packFont(Blob *blob, const char *filename, int size)
+{
+    Font font = { 0 };
+    if (!LoadFont(&font, filename, size))
+    {
+        return false;
+    }
+
+    ArchiveFont *header = (ArchiveFont*)calloc(1, sizeof(ArchiveFont));
+    header->size = size;
+    header->lineSkip = font.lineSkip;
+    header->atlasHeight = font.atlasHeight;
+    memcpy(header->glyphs, font.glyphs, sizeof(header->glyphs));
+    memcpy(header->kerning, font.kerning, sizeof(header->kerning));
+    appendBlob(blob, header, sizeof(ArchiveFont));
+    free(header);
+
+    Uint32 atlas = appendBlob(blob, font.atlas, FONT_ATLAS_WIDTH * MAX(font.atlasHeight, 1));
+    UnloadFont(&font);
+
+    ((ArchiveFont*)blob->a)->atlas = atlas;
+    return true;
+}
+
+static bool packAsset(PackedEntry *packed, const char *arg)
+{
+    memset(packed, 0, sizeof(PackedEntry));
+    kv_init(packed->blob);
+
+    // Named the way the app refers to it
+    const char *name = strncmp(arg, "./", 2) == 0 ? arg + 2 : arg;
+    if (strlen(name) >= ARCHIVE_NAME_LENGTH)
+    {
+        fprintf(stderr, "%s: name too long\n", arg);
+        return false;
+    }
+    strcpy(packed->entry.name, name);
+
+    char filename[256];
+    snprintf(filename, sizeof(filename), "%s", name);
+
+    char *size = strrchr(filename, ':');
+    if (size != NULL) {
+        *size = '\0';
+        packed->entry.type = ARCHIVE_FONT;
+        return packFont(&packed->blob, filename, atoi(size + 1));
+    }
+    if (hasExtension(filename, ".png") || hasExtension(filename, ".jpg") || hasExtension(filename, ".bmp")) {
+        packed->entry.type = ARCHIVE_IMAGE;
+        return packImage(&packed->blob, filename);
+    }
+    if (hasExtension(filename, ".obj")) {
+        packed->entry.type = ARCHIVE_MESH;
+        return packMesh(&packed->blob, filename);
+    }
+    if (hasExtension(filename, ".wav") || hasExtension(filename, ".ogg")) {
+        packed->entry.type = ARCHIVE_SOUND;
+        return packSound(&packed->blob, filename);
+    }
+
+    fprintf(stderr, "%s: unknown asset type\n", arg);
+    return false;
+}
+
+static int compareEntries(const void *a, const void *b)
+{
+    return strncmp(((const PackedEntry*)a)->entry.name, ((const PackedEntry*)b)->entry.name, ARCHIVE_NAME_LENGTH);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <archive> <file>...\n", argv[0]);
+        return 1;
+    }
+
+    // Sounds are converted by a mixer opened as the app opens it, with no
+    // need for an audio device
+    setenv("SDL_AUDIODRIVER", "dummy", 0);
+    SDL_Init(SDL_INIT_AUDIO);
+    IMG_Init(IMG_INIT_PNG);
+    TTF_Init();
+    Mix_Init(MIX_INIT_OGG);
+    Mix_OpenAudio(
+            MIX_DEFAULT_FREQUENCY,
+            MIX_DEFAULT_FORMAT,
+            MIX_DEFAULT_CHANNELS,
+            AUDIO_CHUNK_SIZE
+    );
+
+    int count = argc - 2;
+    PackedEntry *packed = (PackedEntry*)malloc(sizeof(PackedEntry) * MAX(count, 1));
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        if (!packAsset(&packed[i], argv[i + 2])) {
+            fprintf(stderr, "%s: could not pack\n", argv[i + 2]);
+            failed++;
+        }
+    }
+
+    // Sorted for FindArchiveEntry's binary search
+    qsort(packed, count, sizeof(PackedEntry), compareEntries);
+    for (int i = 1; i < count; i++) {
+        if (compareEntries(&packed[i - 1], &packed[i]) == 0) {
+            fprintf(stderr, "%s: packed twice\n", packed[i].entry.name);
+            failed++;
+        }
+    }
+
+    Blob file;
+    kv_init(file);
+    ArchiveHeader header = { ARCHIVE_MAGIC, ARCHIVE_VERSION, (Uint32)count, 0 };
+    appendBlob(&file, &header, sizeof(header));
+    Uint32 toc = appendBlob(&file, NULL, sizeof(ArchiveEntry) * count);
+    for (int i = 0; i < count; i++) {
+        packed[i].entry.offset = appendBlob(&file, packed[i].blob.a, kv_size(packed[i].blob));
+        packed[i].entry.size = (Uint32)kv_size(packed[i].blob);
+        memcpy(file.a + toc + i * sizeof(ArchiveEntry), &packed[i].entry, sizeof(ArchiveEntry));
+        kv_destroy(packed[i].blob);
+    }
+    free(packed);
+
+    FILE *fp = failed == 0 ? fopen(argv[1], "wb") : NULL;
+    bool written = fp != NULL && fwrite(file.a, 1, kv_size(file), fp) == kv_size(file);
+    if (fp != NULL) {
+        written = fclose(fp) == 0 && written;
+    }
+    if (written) {
+        printf("%s: %d assets, %zu bytes\n", argv[1], count, kv_size(file));
+    } else {
+        fprintf(stderr, "%s: not written\n", argv[1]);
+    }
+    kv_destroy(file);
+
+    Mix_CloseAudio();
+    TTF_Quit();
+    SDL_Quit();
+
+    return written ? 0 : 1;
+}